@@ -0,0 +1,35 @@
+#pragma once
+
+#include "chip8.h"
+
+namespace chip8
+{
+	// 由chip9-aot静态翻译得到的基本块
+	struct aot_block_t
+	{
+		// 基本块覆盖[addr, addr+len)
+		word addr;
+		word len;
+
+		// 翻译时的原始指令, 运行时与内存比较以发现自修改的代码
+		const byte* code;
+
+		// 执行整个基本块并更新PC, 返回执行的指令数
+		int (*fn)(machine_t& m);
+	};
+
+	// 一个卡带翻译得到的全部基本块
+	// 生成的文件以extern const aot_program_t <symbol>的形式导出, 使用前需要声明同名的extern变量
+	struct aot_program_t
+	{
+		const char* name;
+
+		// 查找起始于addr的基本块, 不存在时返回nullptr
+		const aot_block_t* (*find)(word addr);
+	};
+
+	// 以翻译后的代码执行至多n个周期, 语义与machine_t::run_for相同
+	// 没有对应基本块的地址(BNNN计算出的跳转目标, 内存中生成的代码等)与被修改过的基本块由machine_t::execute解释执行
+	// 基本块不会跨越n与计时器的边界, 剩余周期不足或挂接了machine_t::trace时逐条解释执行
+	int run_aot(machine_t& m, const aot_program_t& prog, int n);
+} // namespace chip8
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstddef>
+
+namespace chip8
+{
+	constexpr int DEFAULT_SAMPLE_RATE = 44100;
+
+	// 蜂鸣器的方波频率与振幅
+	constexpr int DEFAULT_TONE_HZ = 440;
+	constexpr int16_t TONE_AMPLITUDE = 4096;
+
+	// 一帧至多生成的采样数, 足以容纳192khz
+	constexpr int MAX_FRAME_SAMPLES = 192000 / 60 + 1;
+
+	// 由st驱动的方波发生器
+	// 每个60hz虚拟帧生成一段采样, 采样数与是否发声只取决于帧序号与st, 与宿主的速度无关
+	// sample_rate不是60的整数倍时, 余数累积在frac中, 使长期平均恰好为sample_rate
+	class tone_t
+	{
+	  public:
+		explicit tone_t(int sample_rate = DEFAULT_SAMPLE_RATE, int tone_hz = DEFAULT_TONE_HZ);
+
+		// 生成一帧的采样, on为该帧是否发声, out至少有MAX_FRAME_SAMPLES个位置
+		// 返回写入的采样数
+		int render_frame(bool on, int16_t* out);
+
+		int sample_rate() const { return rate; }
+
+	  private:
+		int rate;
+		int frac;
+		// 32位定点的相位与每个采样的相位增量, 最高位决定方波的正负
+		uint32_t phase;
+		uint32_t step;
+	};
+
+	// 写出16位单声道的PCM WAV文件
+	bool write_wav(const char* path, const int16_t* samples, size_t n, int sample_rate);
+} // namespace chip8
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "chip8.h"
+
+namespace chip8
+{
+	// 一批同步执行的机器数
+	constexpr int BATCH_LANES = 32;
+
+	// 多台机器的步调一致执行
+	// 同一卡带的多个副本(例如fork出的分支)大多数时间停在同一PC上
+	// 寄存器, I, PC, IR与计时器按结构数组保存, 同一PC上的机器共享一次取指与解码, 每条指令以对机器的循环执行, 由编译器向量化
+	// 内存, 显存, 栈与按键等其余状态仍保存在各自的machine_t中
+	// 所有机器在同一PC上时连续执行到计时器递减或PC分歧, PC不同的机器每个周期分组依次执行, 等待按键等少见的情况逐台交给参考实现
+	// 对每台机器给出与machine_t::run_for完全一致的结果, 批量执行不跳过空转, skipped_cycles不变
+	class batch_t
+	{
+	  public:
+		batch_t();
+
+		// 装入count台机器, count不超过BATCH_LANES
+		// 未停机的机器的虚拟时钟必须相同, 且都没有挂接profile与trace, 否则返回false
+		bool load(machine_t* machines, int count);
+
+		// 所有未停机的机器同步执行至多n个周期, 全部停机时提前返回
+		// 停机的机器停在停机时的周期, 与单独执行时相同
+		// 返回实际执行的周期数
+		int run(int n);
+
+		// 把状态写回装入的机器
+		// run之间可以直接修改机器的按键, 其余状态只在store之后才是最新的
+		void store();
+
+		// 装入后以共享解码执行的机器周期数与逐台执行的机器周期数, 用于观察分歧的程度
+		uint64_t shared_steps;
+		uint64_t single_steps;
+
+	  private:
+		// 所有运行中的机器在同一PC上时共享执行至多n条指令, 状态改变或PC分歧时提前返回
+		// 返回执行的周期数, 第一条指令不能共享执行时返回0
+		int run_shared(int n);
+		// 按PC分组执行一个周期
+		void step_cycle();
+		// 按PC分组后执行一组机器的一条指令
+		void step_group(uint32_t group, word ir);
+		// 以参考实现执行一台机器的一个周期
+		void step_single(int l);
+		// 以mask中的机器共享的一条指令更新数据
+		void execute(uint32_t mask, word ir);
+		// execute对base开始的16台机器的部分, mask只包含这16台
+		void execute_lanes(int base, uint32_t mask, word ir);
+
+		// 在结构数组与machine_t之间复制
+		void scatter(int l);
+		void gather(int l);
+
+		// 机器的状态改变后更新掩码
+		void update_state(int l);
+		// 计时器递减时更新未停机的机器
+		void update_timers();
+
+		// 记录被写入过的内存, 从这些地址取指时需要逐台比较指令
+		void mark_written(word addr, int len);
+
+		alignas(32) byte V[16][BATCH_LANES];
+		alignas(32) word I[BATCH_LANES];
+		alignas(32) word PC[BATCH_LANES];
+		alignas(32) word IR[BATCH_LANES];
+		alignas(32) byte dt[BATCH_LANES];
+		alignas(32) byte st[BATCH_LANES];
+
+		machine_t* lanes;
+		int count;
+
+		// 未停机的机器与其中处于STATE_RUNNING的机器, 每位对应一台
+		uint32_t active;
+		uint32_t running;
+
+		// 共享的虚拟时钟, 只使用其中的时钟字段
+		machine_t clock;
+
+		// 装入时第一台未停机的机器的内存, 没有被写入过的地址上所有机器的内容都与此相同
+		byte code[MEM_SIZE];
+		byte written[MEM_SIZE];
+	};
+} // namespace chip8
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 
 using byte = uint8_t;
@@ -11,8 +13,8 @@ namespace chip8
 	{
 		// 正常运行中
 		STATE_RUNNING,
-		// 屏幕像素更新
-		STATE_VRAM_UPDATE,
+		// 启用QUIRK_VBLANK_WAIT时, 绘制之后等待到下一次计时器递减(即垂直消隐)再继续执行
+		STATE_WAIT_VBLANK,
 		// 等待按键输入
 		// 经典vip模式时, 将等待一个完整的按键按下-松开过程
 		STATE_WAIT_KEY,
@@ -27,9 +29,26 @@ namespace chip8
 		STATE_ERROR_POP_EMPTY_STAKC,
 	};
 
-    const char* state_str(state_t st);
+	const char* state_str(state_t st);
+
+	// 空转的种类, 见machine_t::idle
+	enum idle_t
+	{
+		// 正常执行
+		IDLE_NONE,
+		// 0xFX0A等待按键, 或是只检查按键与寄存器的轮询循环
+		// 按键状态变化之前, 除时钟外的状态都不会改变
+		IDLE_INPUT,
+		// 读取delay_timer的轮询循环, 如FX07, 3XNN与跳回FX07的1NNN
+		// 计时器递减或按键状态变化之前, 除时钟外的状态都不会改变
+		IDLE_TIMER,
+	};
+
+	struct profile_t;
+	class trace_writer_t;
+	struct snapshot_t;
 
-	// 4069字节的内存
+	// 4096字节的内存
 	constexpr int MEM_SIZE = 0x1000;
 
 	// 程序起始偏移为0x200
@@ -40,30 +59,257 @@ namespace chip8
 	constexpr int SCREEN_HEIGHT = 32;
 
 	// 栈深度, 决定子程序嵌套深度
-	constexpr int STACK_DEEP = 12;
+	constexpr int STACK_DEEP = 16;
+
+	// 默认以每秒700个指令的速度执行
+	constexpr uint32_t DEFAULT_IPS = 700;
+
+	// 计时器的递减频率
+	constexpr uint32_t TIMER_HZ = 60;
+
+	// reset后随机数发生器的初始状态
+	constexpr uint32_t DEFAULT_RNG_SEED = 0x2545F491;
+
+	// 可选的兼容行为, 可以按位组合
+	enum quirk_t : uint32_t
+	{
+		// 与cosmac vip一致, DXYN之后等待垂直消隐, 每帧至多绘制一次, 减少闪烁
+		QUIRK_VBLANK_WAIT = 1 << 0,
+	};
+
+	// 一台完整的chip8机器
+	// 所有运行时状态都保存在实例中, 实例之间没有共享的可变状态, 可以被不同线程同时驱动
+	struct machine_t
+	{
+		// 4KB内存
+		byte ram[MEM_SIZE];
+
+		// 显存, 每行一个64位字, 最高位对应x=0
+		uint64_t vram[SCREEN_HEIGHT];
+
+		// 上次取走之后内容发生变化的行, 每位对应一行
+		uint32_t dirty_rows;
+
+		// 显存的Zobrist散列, 即所有点亮像素的键的异或, 由draw与clear_vram增量维护
+		// 空白画面为0, 可以O(1)地判断两帧是否相同
+		uint64_t frame_hash;
+
+		// 16个通用寄存器
+		byte reg[16];
+
+		// 地址寄存器
+		word I;
+
+		// 指令与程序计数器
+		word IR;
+		word PC;
+
+		// 堆栈与栈顶指针
+		word stack[STACK_DEEP];
+		byte SP;
+
+		// 计时器
+		byte dt;
+		byte st;
+
+		// 执行状态
+		state_t state;
+
+		// 0xFX0A等待按键时记录的寄存器编号
+		byte cached_reg;
+
+		// 字体精灵的储存位置
+		word font_mem_offset;
+
+		// 按键状态, 每位对应一个键
+		// keys_released记录按下后又松开的键, 供0xFX0A使用
+		word keys;
+		word keys_released;
+
+		// 虚拟时钟
+		// 每条指令(包括等待按键时的空转)计一个周期, 计时器按周期数以60hz递减, 与宿主的速度无关
+		uint64_t cycles;
+		// 计时器已递减的次数与下一次递减所在的周期
+		uint64_t ticks;
+		uint64_t next_tick;
+		// st非零时经过的递减次数, 即发声的帧数
+		// 一帧内增加时该帧发声, FX18设置的st在当帧就开始发声, 共持续st帧
+		uint64_t sound_ticks;
+		// skip_idle直接推进而没有逐条执行的周期数
+		uint64_t skipped_cycles;
+		// 每秒执行的指令数
+		// ips不是60的整数倍时, 余数累积在tick_frac中, 使长期平均恰好为60hz
+		uint32_t ips;
+		uint32_t tick_frac;
+
+		// CXNN使用的xorshift32状态, 与其他状态一起保存在快照中
+		uint32_t rng;
+
+		// 启用的quirk_t
+		uint32_t quirks;
+
+		// 上次在跳转之后没有找到可以推进的空转循环时的ticks, 同一帧内不再检测
+		uint64_t idle_miss_tick;
 
-	// 读取显存
-	bool read_vram(int x, int y);
+		// 性能剖析数据与执行轨迹, 为空时不记录
+		// reset不会改变挂接的对象
+		profile_t* profile;
+		trace_writer_t* trace;
 
-	// 读取定时器
-	void read_timer(byte* delay_timer, byte* sound_timer);
+		// 重置运行时状态并装载程序
+		// font为空时使用默认字体, 参数无效时返回false
+		// 时钟恢复为DEFAULT_IPS, 关闭所有quirk, 随机数种子恢复为DEFAULT_RNG_SEED
+		bool reset(const byte* rom, int rom_len, const byte* font, int _font_mem_offset, int font_len);
 
-	// 设置键状态
-	void set_key_state(int key_id, bool pressed);
+		// 保存完整的机器状态
+		void snapshot(snapshot_t* s) const;
 
-    // 重置运行时状态并装载程序
-	void reset(const byte* rom, int rom_len, const byte* font, int _font_mem_offset, int font_len);
+		// 恢复快照, 保留当前挂接的profile与trace, 之后整屏重绘
+		// 使用预解码或编译执行的引擎需要随后调用其invalidate_all
+		void restore(const snapshot_t& s);
 
-	// 从内存获取一条指令
-	void fetch(state_t* state);
+		// 设置每秒执行的指令数, 从下一次计时器递减之后生效
+		void set_clock(uint32_t _ips) { ips = _ips ? _ips : DEFAULT_IPS; }
 
-    // 执行当前获取的指令
-	void execute(state_t* state, byte* cached_reg);
+		// 设置启用的quirk_t
+		void set_quirks(uint32_t _quirks) { quirks = _quirks; }
+
+		// 设置随机数种子, xorshift的状态不能为0, 此时使用DEFAULT_RNG_SEED
+		void seed_rng(uint32_t seed) { rng = seed ? seed : DEFAULT_RNG_SEED; }
+
+		// 执行至多n个周期, 停机时提前返回
+		// 绘制只更新显存与dirty_rows, 不会中断执行, 由调用者在帧结束时统一重绘
+		// 返回实际执行的周期数
+		int run_for(int n);
+
+		// 判断机器是否处于可识别的空转循环中
+		idle_t idle() const;
+
+		// 机器空转时直接推进至多n个周期, 结果与逐条执行相同, 返回推进的周期数
+		// 等待输入时推进全部n个周期, 只轮询按键时推进整数轮循环, 延时轮询时逐帧模拟delay_timer直到循环退出
+		// 挂接了profile或trace时不推进, 使每个周期都被记录
+		int skip_idle(int n)
+		{
+			// 只在1NNN跳转之后检查, 循环中途开始时先执行到循环的开头
+			if (state == STATE_RUNNING && ((IR >> 12) != 0x1 || idle_miss_tick == ticks))
+				return 0;
+			return fast_forward(n);
+		}
+
+		// skip_idle的实现
+		int fast_forward(int n);
+
+		// 执行到下一次计时器递减, 即一个60hz的虚拟帧
+		int run_frame() { return run_for((int)(next_tick - cycles)); }
+
+		// 推进n个周期, 跨过60hz边界时递减计时器并结束垂直消隐的等待
+		void advance(uint64_t n)
+		{
+			cycles += n;
+			while (cycles >= next_tick)
+			{
+				update_timer();
+				ticks++;
+				schedule_tick();
+
+				if (state == STATE_WAIT_VBLANK)
+					state = STATE_RUNNING;
+			}
+		}
+
+		// 从内存获取一条指令
+		void fetch();
+
+		// 执行当前获取的指令
+		// 在执行完毕后处理异常state, 停止运行或是重置state后再调用execute继续执行
+		void execute();
+
+		// 更新定时器
+		// 令非零的计时器减一, 通常由advance在60hz的边界上调用
+		void update_timer();
+
+		// 生成一个随机字节
+		byte random()
+		{
+			rng ^= rng << 13;
+			rng ^= rng >> 17;
+			rng ^= rng << 5;
+			return (byte)(rng >> 24);
+		}
+
+		// 读取显存
+		bool read_vram(int x, int y) const;
+
+		// 显存内容的64位FNV-1a散列, 逐行按x从小到大的字节顺序计算, 与宿主字节序无关
+		// 需要扫描整个显存, 用于持久保存的结果, 进程内比较画面使用frame_hash
+		uint64_t hash_vram() const;
+
+		// 取走并清空变化过的行
+		uint32_t take_dirty_rows()
+		{
+			uint32_t rows = dirty_rows;
+			dirty_rows = 0;
+			return rows;
+		}
+
+		// 读取定时器
+		void read_timer(byte* delay_timer, byte* sound_timer) const;
+
+		// 设置键状态
+		void set_key_state(int key_id, bool pressed);
+
+		// debug信息
+		// 包含各寄存器的值等, 返回的字符串在同一线程下次调用前有效
+		const char* debug_info() const;
+
+		// 是否因死循环或错误而停机
+		bool halted() const { return state >= STATE_INFINITE_LOOP; }
+
+		// 是否在等待按键或垂直消隐, 等待中的周期照常计数
+		bool waiting() const { return state == STATE_WAIT_KEY || state == STATE_WAIT_VBLANK; }
+
+		// 在屏幕上绘制精灵
+		// 将对x,y进行取模, 绘制冲突时设置VF为1
+		void draw(int x, int y, const byte* sp, int h);
+
+		// 清屏
+		void clear_vram();
+
+		// 计算下一次计时器递减所在的周期
+		void schedule_tick()
+		{
+			next_tick += ips / TIMER_HZ;
+			tick_frac += ips % TIMER_HZ;
+			if (tick_frac >= TIMER_HZ)
+			{
+				tick_frac -= TIMER_HZ;
+				next_tick++;
+			}
+		}
+	};
+
+	// 机器状态的快照
+	// machine_t的全部状态都在实例之内, 快照即实例的完整拷贝
+	struct snapshot_t
+	{
+		machine_t m;
+	};
+
+	// 从take_dirty_rows的结果中取出下一段连续的行[*y0, *y1)
+	// 没有剩余的行时返回false
+	inline bool next_dirty_span(uint32_t* rows, int* y0, int* y1)
+	{
+		if (!*rows)
+			return false;
 
-	// 更新定时器
-	void update_timer();
+		int y = 0;
+		while (!(*rows & (1u << y)))
+			y++;
 
-    // debug信息
-    // 包含各寄存器的值等
-    const char* debug_info();
-} // namespace chip8
\ No newline at end of file
+		*y0 = y;
+		while (y < SCREEN_HEIGHT && (*rows & (1u << y)))
+			*rows &= ~(1u << y++);
+		*y1 = y;
+		return true;
+	}
+} // namespace chip8
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 
 using byte = uint8_t;
@@ -11,25 +13,40 @@ enum class key_state_t : byte
 	RELEASE
 };
 
-// 由chip8实现
+// 由frontend实现
+// present由渲染线程调用, 其余函数在start之后只能由驱动机器的模拟线程调用
 void start(const char* file_path);
-void update();
+bool update();	// 执行一个虚拟帧并发布帧结束时的画面, 机器停机后返回false
+void present(); // 取走最近发布的画面, 重绘自上次重绘以来变化过的行
+
+void set_clock(uint32_t ips);			  // 设置每秒执行的指令数
+void set_vblank_wait(bool on);			  // 绘制精灵后是否等待垂直消隐
+void set_seed(uint32_t seed);			  // 设置随机数种子
+bool record_movie(const char* path);	  // 从头录制输入录像, 需在start与上述设置之后, 运行之前调用
+bool play_movie(const char* path);		  // 从头回放输入录像并采用其中的设置, 回放期间忽略实时按键
+bool stop_movie();						  // 结束录像, 录制时写出文件
+bool set_trace(const char* path);		  // 将执行轨迹写入文件, 为空时停止记录
+bool rewind_frames(int frames);			  // 倒回frames个虚拟帧, 历史不足时返回false
+void save_state();						  // 保存即时存档
+bool load_state();						  // 读取即时存档, 没有存档时返回false
+bool waiting_input();					  // 机器停机或在按键变化之前不会再有任何变化, 此时可以阻塞等待事件
 
 const char* state_str();
 
 // 由后端实现
-void clear_screen();
-void screen_pixel(uint x, uint y, bool f); // 更新屏幕
+void screen_present(const uint32_t* pixels); // 提交SCREEN_WIDTH*SCREEN_HEIGHT的RGBA32画面, 内存中的字节顺序为R,G,B,A
 
 key_state_t get_key(byte key);				   // 检查特定键是否按下
 bool any_key(key_state_t state, byte* key_id); // 检查是否有任何键按下并返回触发的键id
 
 // 通用
 bool load_file(const char* filename, byte* buffer, int* len);
-void buzzer(int frequency, int duration); // 播放蜂鸣器
-void delay_ms(uint32_t ms);				  // 延迟
-void delay_ns(uint32_t ns);				  // 延迟
+
+// 由后端实现
+bool audio_open(int sample_rate);				 // 打开16位单声道的音频输出, 失败时静音运行
+void audio_close();								 // 关闭音频输出
+void audio_queue(const int16_t* samples, int n); // 由模拟线程提交采样, 缓冲已满时丢弃多余的部分, 从不阻塞
+void delay_ms(uint32_t ms);						 // 延迟
+void delay_ns(uint32_t ns);						 // 延迟
 uint64_t uptime_ns();
 uint64_t uptime_ms();
-
-inline bool debug_out() { return false; }
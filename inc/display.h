@@ -0,0 +1,38 @@
+#pragma once
+
+#include "chip8.h"
+
+namespace chip8
+{
+	// 熄灭的像素每次更新降低的亮度, 约6次更新后完全淡出
+	constexpr byte DISPLAY_DECAY = 43;
+
+	// 把打包的显存展开为RGBA32画面
+	// 每个像素保存一个亮度, 点亮时为255, 熄灭后逐次衰减, 以模拟荧光屏的余辉
+	// 画面按亮度在前景色与预先合成的棋盘格背景之间插值, 与宿主窗口的尺寸无关
+	class display_t
+	{
+	  public:
+		display_t();
+
+		// 以一帧显存更新亮度并重新展开画面, 每次调用推进一步淡出
+		// hash为该帧的frame_hash, 与上次相同且没有正在淡出的像素时不做任何事并返回false
+		bool update(const uint64_t* vram, uint64_t hash);
+
+		// SCREEN_WIDTH*SCREEN_HEIGHT个像素, 按行排列, 内存中的字节顺序为R,G,B,A
+		const uint32_t* pixels() const { return rgba; }
+
+		// 使下一次update无条件重新展开
+		void invalidate() { valid = false; }
+
+	  private:
+		alignas(16) byte intensity[SCREEN_HEIGHT * SCREEN_WIDTH];
+		alignas(16) byte background[SCREEN_HEIGHT * SCREEN_WIDTH];
+		alignas(16) uint32_t rgba[SCREEN_HEIGHT * SCREEN_WIDTH];
+
+		uint64_t last_hash;
+		// 上次更新后仍有亮度介于0与255之间的像素
+		bool fading;
+		bool valid;
+	};
+} // namespace chip8
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "chip8.h"
+#include "jit.h"
+#include "predecode.h"
+
+namespace chip8
+{
+	// 可选的执行引擎
+	enum engine_t
+	{
+		// machine_t::run_for, 参考实现
+		ENGINE_REF,
+		// 预解码解释器
+		ENGINE_PREDECODE,
+		// x86-64基本块编译器
+		ENGINE_JIT,
+
+		ENGINE_COUNT,
+	};
+
+	const char* engine_str(engine_t e);
+
+	// 按名称查找引擎, 不存在时返回false
+	bool engine_from_str(const char* name, engine_t* e);
+
+	// 以选定的引擎驱动一台机器
+	// 各引擎的run语义与machine_t::run_for相同, 对同样的输入给出完全一致的机器状态
+	class runner_t
+	{
+	  public:
+		runner_t(machine_t& m, engine_t e);
+		~runner_t();
+
+		runner_t(const runner_t&) = delete;
+		runner_t& operator=(const runner_t&) = delete;
+
+		int run(int n);
+
+		// 机器被其他途径修改(reset, restore等)后丢弃引擎缓存
+		void invalidate();
+
+		machine_t& machine() { return m; }
+		engine_t engine() const { return e; }
+
+	  private:
+		machine_t& m;
+		engine_t e;
+
+		predecoded_t* pre;
+		jit_t* jit;
+	};
+} // namespace chip8
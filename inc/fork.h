@@ -0,0 +1,76 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace chip8
+{
+	// 从parent派生一台独立的机器
+	// 复制全部机器状态, 不复制挂接的profile与trace
+	void fork(const machine_t& parent, machine_t* child);
+
+	// 以按键状态keys(每位对应一个键)执行frames个60hz虚拟帧, 停机时提前结束
+	// 返回实际执行的帧数
+	int run_frames(machine_t& m, word keys, int frames);
+
+	// 并行探索多个分支的线程池
+	// 工作线程在构造时创建并常驻, 调用线程同样参与执行
+	class fork_pool_t
+	{
+	  public:
+		// threads为0时使用硬件线程数
+		explicit fork_pool_t(int threads = 0);
+		~fork_pool_t();
+
+		fork_pool_t(const fork_pool_t&) = delete;
+		fork_pool_t& operator=(const fork_pool_t&) = delete;
+
+		// 从parent派生keys.size()个分支, 第i个分支以keys[i]执行frames帧
+		// 分支保存在children中以便继续探索, hashes[i]为第i个分支结束时的frame_hash
+		void explore(const machine_t& parent, const std::vector<word>& keys, int frames,
+			std::vector<machine_t>& children, std::vector<uint64_t>& hashes);
+
+		// 让已有的分支machines[i]以keys[i]继续执行frames帧
+		void step(std::vector<machine_t>& machines, const std::vector<word>& keys, int frames,
+			std::vector<uint64_t>& hashes);
+
+		int threads() const { return (int)workers.size() + 1; }
+
+	  private:
+		// 由各线程并行执行的一批任务
+		struct job_t
+		{
+			const machine_t* parent;
+			machine_t* machines;
+			const word* keys;
+			uint64_t* hashes;
+			int frames;
+			size_t count;
+		};
+
+		// 领取并执行任务直到全部领完
+		void work(const job_t& j);
+		void worker_loop();
+
+		void run_job(const job_t& j);
+
+		std::vector<std::thread> workers;
+
+		std::mutex lock;
+		std::condition_variable cv;
+		// 每提交一批任务加一, 工作线程据此发现新任务
+		uint64_t generation;
+		bool stopping;
+
+		job_t job;
+		// 下一个未领取的任务
+		std::atomic<size_t> next;
+		// 正在执行任务的线程数, 为0之前不会提交下一批任务
+		int busy;
+	};
+} // namespace chip8
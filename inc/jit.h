@@ -0,0 +1,80 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace chip8
+{
+	// x86-64下的基本块动态编译器
+	// 将连续的赋值/算术指令翻译为本机代码, 基本块在跳转, 跳过, 绘制, 按键等指令处结束
+	// 3XNN/4XNN/5XY0/9XY0与1NNN作为基本块的出口直接翻译, 其余指令回退到machine_t::execute
+	// FX33/FX55写入已翻译的代码时, 对应的基本块会被丢弃并在下次执行时重新翻译
+	// 通过其他途径修改了机器(reset, machine_t::execute等)后需要调用invalidate_all
+	class jit_t
+	{
+	  public:
+		explicit jit_t(machine_t& m);
+		~jit_t();
+
+		jit_t(const jit_t&) = delete;
+		jit_t& operator=(const jit_t&) = delete;
+
+		// 当前平台是否能生成本机代码
+		// 不支持时run退化为解释执行
+		bool supported() const { return code != nullptr; }
+
+		// 执行至多n个周期, 语义与machine_t::run_for相同
+		// 基本块不会跨越n, 含有FX07/FX15/FX18的基本块不会跨越计时器递减的边界, 其余基本块执行后统一推进时钟
+		// 剩余周期不足或挂接了machine_t::trace时逐条解释执行
+		int run(int n);
+
+		// 使覆盖[addr, addr+len)的基本块失效, 地址超出内存时回绕到开头, 与FX33/FX55的写入一致
+		void invalidate(word addr, int len);
+		// 使内存内容与翻译时不同的基本块失效
+		void invalidate_all();
+
+	  private:
+		// 基本块入口, 返回执行的指令数
+		using block_fn = int (*)(machine_t* m);
+
+		struct block_t
+		{
+			block_fn fn;
+			// 基本块覆盖的内存范围为[起始地址, end)
+			word end;
+			// 指令数
+			int len;
+			// 读写了计时器, 执行中途不能有计时器递减
+			bool timed;
+		};
+
+		// 翻译从addr开始的基本块, 首条指令无法翻译时记录为空的基本块并返回false
+		bool compile(word addr);
+
+		// 用参考实现执行一条指令
+		void step();
+
+		void invalidate_range(int begin, int end);
+		// 丢弃全部基本块与代码
+		void discard_all();
+
+		bool compiled(word addr) const { return (valid[addr / 64] >> (addr % 64)) & 1; }
+
+		machine_t& m;
+
+		// 只有valid中对应位为1的基本块有效, 清空时不必改写整个表
+		block_t blocks[MEM_SIZE];
+		uint64_t valid[MEM_SIZE / 64];
+		// 翻译时的内存内容, 只有基本块覆盖的部分是准确的
+		byte source[MEM_SIZE];
+
+		// 每256字节内存页上的基本块起始地址
+		std::vector<word> page_blocks[MEM_SIZE / 256];
+
+		// 可执行代码缓冲
+		byte* code;
+		size_t code_used;
+	};
+} // namespace chip8
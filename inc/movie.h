@@ -0,0 +1,64 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace chip8
+{
+	// 输入录像的二进制格式
+	// 文件头为"C9MV"与u16版本号, 之后是u64 rom_hash, u32 seed, u32 ips, u32 quirks, u64 length, u32 事件数
+	// 每个事件为一个LEB128变长整数: (相对上一事件的周期数 << 5) | (按下 << 4) | 键, 多字节数值均为小端
+	constexpr char MOVIE_MAGIC[4] = {'C', '9', 'M', 'V'};
+	constexpr word MOVIE_VERSION = 1;
+
+	// 在第cycle个周期之前改变一个键的状态
+	struct movie_event_t
+	{
+		uint64_t cycle;
+		byte key;
+		bool pressed;
+	};
+
+	// 输入录像
+	// 机器的运行只取决于reset后的配置, 随机数种子与每次按键变化所在的周期
+	// 录像保存这些内容, 回放时可以以任意速度和任意引擎逐周期重现整个运行过程
+	class movie_t
+	{
+	  public:
+		// 程序区内容的散列, 回放前校验卡带
+		uint64_t rom_hash;
+		// reset之后的随机数状态, 时钟与quirk
+		uint32_t seed;
+		uint32_t ips;
+		uint32_t quirks;
+		// 录制结束时的周期
+		uint64_t length;
+		// 按周期排序, 同一周期内保持发生的顺序
+		std::vector<movie_event_t> events;
+
+		movie_t();
+
+		// 从刚reset并配置好的机器开始录制, 机器已经运行过时返回false
+		bool begin(const machine_t& m);
+
+		// 记录一次按键变化, 周期不能早于之前的事件
+		void record(uint64_t cycle, int key, bool pressed);
+
+		// 倒带或读档到cycle之后, 丢弃在那之后发生的事件
+		void truncate(uint64_t cycle);
+
+		// 把配置应用到刚reset的机器, 卡带不符时返回false
+		bool apply(machine_t& m) const;
+
+		// 第一个不早于cycle的事件
+		size_t seek(uint64_t cycle) const;
+
+		bool save(const char* path) const;
+		bool load(const char* path);
+	};
+
+	// 程序区内容的散列, 与卡带长度无关
+	uint64_t hash_program(const machine_t& m);
+} // namespace chip8
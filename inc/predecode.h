@@ -0,0 +1,59 @@
+#pragma once
+
+#include "chip8.h"
+
+namespace chip8
+{
+	class predecoded_t;
+	struct op_t;
+
+	// 指令处理函数
+	// pc为下一条指令的地址, 返回之后执行的地址, 处理函数不读写machine_t::PC与IR
+	using op_handler_t = word (*)(predecoded_t& e, const op_t& op, word pc);
+
+	// 预解码的指令
+	// 各字段在解码时就已从指令中拆出
+	struct op_t
+	{
+		// 为空时表示该地址尚未解码
+		op_handler_t fn;
+
+		// 原始指令
+		word raw;
+
+		word nnn;
+		byte x;
+		byte y;
+		byte n;
+		byte nn;
+	};
+
+	// 带预解码缓存的解释器
+	// 缓存按PC索引, 每个地址只在第一次执行时解码, 之后直接跳转到处理函数
+	// FX33/FX55写入内存时会使被覆盖的缓存项失效
+	// 通过其他途径修改了机器(reset, machine_t::execute等)后需要调用invalidate_all
+	class predecoded_t
+	{
+	  public:
+		explicit predecoded_t(machine_t& m);
+
+		// 执行至多n个周期, 语义与machine_t::run_for相同
+		int run(int n);
+
+		// 使[addr, addr+len)范围内的缓存失效
+		void invalidate(word addr, int len);
+		void invalidate_all();
+
+		machine_t& machine() { return m; }
+
+	  private:
+		const op_t& decode(word addr);
+
+		// 连续执行至多n条指令, 不推进周期
+		// PC只保存在局部变量中, 状态改变或需要检查空转的跳转之后写回并返回
+		int run_block(int n);
+
+		machine_t& m;
+		op_t ops[MEM_SIZE];
+	};
+} // namespace chip8
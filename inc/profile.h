@@ -0,0 +1,62 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+namespace chip8
+{
+	// 默认每执行997条指令采样一次调用栈, 取质数以避免与程序中的循环同步
+	constexpr uint32_t DEFAULT_SAMPLE_PERIOD = 997;
+
+	// 客户程序的性能剖析数据
+	// 挂到machine_t::profile后由各引擎在执行每条指令时记录, 未挂接时只多一次指针判断
+	struct profile_t
+	{
+		// 按指令地址统计的执行次数
+		uint64_t pc_hits[MEM_SIZE];
+
+		// 按指令最高4位统计的执行次数
+		uint64_t op_hits[16];
+
+		// STATE_WAIT_KEY中空转的周期数
+		uint64_t wait_key_cycles;
+
+		// 调用栈采样, 键为从栈底到栈顶的调用点地址, 最后一项为采样时的PC
+		std::map<std::vector<word>, uint64_t> stacks;
+		uint32_t sample_period;
+		uint32_t sample_left;
+
+		explicit profile_t(uint32_t period = DEFAULT_SAMPLE_PERIOD) { clear(period); }
+
+		void clear(uint32_t period = DEFAULT_SAMPLE_PERIOD);
+
+		// 记录一条取出的指令, addr为指令所在地址
+		void count(const machine_t& m, word addr, word ir)
+		{
+			pc_hits[addr & (MEM_SIZE - 1)]++;
+			op_hits[ir >> 12]++;
+			if (!--sample_left)
+				sample(m, addr);
+		}
+
+		// 记录从addr开始连续执行的len条指令, 供以基本块为单位执行的引擎使用
+		void count_block(const machine_t& m, word addr, int len);
+
+		void count_wait() { wait_key_cycles++; }
+
+		// 执行的绘制指令数
+		uint64_t draws() const { return op_hits[0xD]; }
+
+		// 平面剖析: 指令类别, 等待与绘制统计以及最热的top个地址
+		void dump_flat(FILE* f, const machine_t& m, int top = 32) const;
+
+		// 折叠栈格式, 每行一个调用栈与其采样数, 可直接交给flamegraph.pl等工具
+		void dump_collapsed(FILE* f) const;
+
+	  private:
+		void sample(const machine_t& m, word addr);
+	};
+} // namespace chip8
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+namespace chip8
+{
+	// 默认最多占用8MB
+	constexpr size_t DEFAULT_REWIND_BUDGET = 8 << 20;
+
+	// 每60帧(1秒)一个关键帧
+	constexpr int DEFAULT_REWIND_KEYFRAME_INTERVAL = 60;
+
+	// 倒带缓冲
+	// 每帧保存一次机器状态, 状态以与所在段关键帧的异或差分保存, 关键帧则是与第一帧的异或差分
+	// 程序与字体等不变的内容只在第一帧中保存一次, 差分中的零字节按游程压缩
+	// 恢复任意一帧只需解码关键帧与该帧的差分, 与历史长度无关
+	// 超出预算时整段丢弃最旧的帧
+	class rewind_t
+	{
+	  public:
+		explicit rewind_t(size_t budget = DEFAULT_REWIND_BUDGET, int keyframe_interval = DEFAULT_REWIND_KEYFRAME_INTERVAL);
+
+		// 保存一帧
+		void push(const machine_t& m);
+
+		// 恢复到back帧之前保存的状态, back为0时是最近一次push的帧
+		// 不丢弃更新的帧, 可以来回拖动, 语义同machine_t::restore
+		bool restore(machine_t& m, size_t back) const;
+
+		// 丢弃最近的n帧, 从倒回的位置继续运行前调用
+		void drop(size_t n);
+
+		void clear();
+
+		size_t frames() const { return count; }
+
+		// 已保存的数据量
+		size_t bytes() const { return used; }
+
+	  private:
+		// 一个关键帧与之后的若干帧
+		struct segment_t
+		{
+			// 关键帧与base的差分
+			std::vector<byte> key;
+			// 各帧的差分首尾相接保存, ends[i]为第i帧差分的结束位置
+			std::vector<byte> deltas;
+			std::vector<uint32_t> ends;
+		};
+
+		// 将a^b编码为零字节游程与字面量交替的序列
+		static void encode(const byte* a, const byte* b, std::vector<byte>& out);
+		// 将编码的差分异或到dst上
+		static void apply(const byte* src, size_t len, byte* dst);
+
+		static size_t segment_bytes(const segment_t& s);
+
+		std::deque<segment_t> segments;
+
+		// 清空后push的第一帧原文, 所有关键帧的基准
+		snapshot_t base;
+
+		// 最新一段的关键帧原文, 用于计算帧的差分
+		snapshot_t key_state;
+
+		size_t budget;
+		int interval;
+		size_t count;
+		size_t used;
+	};
+} // namespace chip8
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace chip8
+{
+	// 每次调度执行的默认周期数
+	constexpr int DEFAULT_QUANTUM = 4096;
+
+	// 不限制执行的周期数
+	constexpr uint64_t UNLIMITED_CYCLES = UINT64_MAX;
+
+	// 机器离开运行队列的原因
+	enum park_t
+	{
+		// 在运行队列中或正在执行
+		PARK_NONE,
+		// 等待按键或只轮询按键, 由set_keys唤醒
+		PARK_INPUT,
+		// 死循环, 无效指令或栈错误, 由load唤醒
+		PARK_HALTED,
+		// 执行完给定的周期数, 由extend或load唤醒
+		PARK_DONE,
+	};
+
+	const char* park_str(park_t p);
+
+	struct machine_stats_t
+	{
+		uint64_t cycles;
+		// 被调度执行的次数与离开运行队列的次数
+		uint64_t slices;
+		uint64_t parks;
+		// 执行所用的时间
+		uint64_t busy_ns;
+		park_t park;
+	};
+
+	struct worker_stats_t
+	{
+		uint64_t slices;
+		// 从其他线程的队列偷取的次数
+		uint64_t steals;
+		// 执行所用的时间, 与uptime_ns之比即为利用率
+		uint64_t busy_ns;
+	};
+
+	// 在工作窃取线程池上分时运行大量机器
+	// 每台机器每次执行至多quantum个周期, 之后回到执行它的线程的队列尾部, 空闲的线程从其他队列尾部偷取
+	// 等待输入, 停机或执行完周期数的机器离开队列, 不占用线程, 直到输入或控制事件唤醒
+	// 离开队列期间机器的虚拟时钟停止, 唤醒后从离开时的周期继续
+	// add, set_keys, extend与load只能在同一个控制线程调用
+	class scheduler_t
+	{
+	  public:
+		// threads为0时使用硬件线程数
+		explicit scheduler_t(int threads = 0, int quantum = DEFAULT_QUANTUM);
+		~scheduler_t();
+
+		scheduler_t(const scheduler_t&) = delete;
+		scheduler_t& operator=(const scheduler_t&) = delete;
+
+		// 加入一台机器并执行cycles个周期, 返回编号
+		// 复制机器状态, 不复制挂接的profile与trace
+		int add(const machine_t& m, uint64_t cycles = UNLIMITED_CYCLES);
+
+		// 设置按键状态(每位对应一个键), 在下一次执行之前生效
+		// 多次调用按顺序生效, 与在两次执行之间依次调用machine_t::set_key_state相同
+		// 即使机器在两次调用之间没有执行, 按下又松开的键也会记入keys_released, 使FX0A得到按键
+		void set_keys(int id, word keys);
+		// 再执行cycles个周期
+		void extend(int id, uint64_t cycles);
+		// 以m替换机器状态, 在下一次执行之前生效
+		void load(int id, const machine_t& m);
+
+		// 等待所有机器离开运行队列
+		void wait_idle();
+
+		// 只在wait_idle之后有效
+		const machine_t& machine(int id) const { return slots[id]->m; }
+
+		int size() const { return (int)slots.size(); }
+		int threads() const { return (int)workers.size(); }
+
+		machine_stats_t machine_stats(int id);
+		worker_stats_t worker_stats(int i) const;
+		uint64_t uptime_ns() const;
+
+	  private:
+		struct slot_t
+		{
+			machine_t m;
+
+			// 保护以下由控制线程修改的字段
+			std::mutex lock;
+			// 执行到此周期为止
+			uint64_t until;
+			bool has_keys;
+			// 最后一次set_keys的状态, 以及上次执行之后松开过的键
+			word level;
+			word released;
+			std::unique_ptr<machine_t> pending;
+			park_t park;
+
+			// 只由执行机器的线程修改
+			std::atomic<uint64_t> cycles;
+			std::atomic<uint64_t> slices;
+			std::atomic<uint64_t> parks;
+			std::atomic<uint64_t> busy_ns;
+		};
+
+		struct worker_t
+		{
+			std::mutex lock;
+			std::deque<slot_t*> queue;
+
+			std::atomic<uint64_t> slices;
+			std::atomic<uint64_t> steals;
+			std::atomic<uint64_t> busy_ns;
+
+			std::thread thread;
+		};
+
+		void worker_loop(int self);
+
+		// 取自己队列的头部, 没有时偷取其他队列的尾部
+		slot_t* take(int self);
+		// 由线程w执行一次, 返回机器是否仍留在运行队列
+		bool run_slice(worker_t& w, slot_t* s);
+
+		void push(int i, slot_t* s, bool notify);
+		// 在持有s->lock时调用, 让离开队列的机器重新进入
+		void wake(slot_t* s);
+
+		int quantum;
+		std::vector<std::unique_ptr<slot_t>> slots;
+		std::vector<std::unique_ptr<worker_t>> workers;
+
+		std::chrono::steady_clock::time_point start;
+
+		// 队列中的机器总数, 以及等待新机器的线程数
+		std::atomic<int> queued;
+		std::atomic<int> sleeping;
+		// 控制线程放入新机器的位置
+		int next_worker;
+
+		std::mutex lock;
+		std::condition_variable cv;
+		std::condition_variable idle_cv;
+		// 在队列中或正在执行的机器数
+		int live;
+		bool stopping;
+	};
+} // namespace chip8
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// 单生产者单消费者的线程间通信
+namespace chip8
+{
+	// 无锁的环形队列
+	// push只能由一个线程调用, pop与empty只能由另一个线程调用, 容量N必须是2的幂
+	template <typename T, size_t N>
+	class spsc_queue_t
+	{
+		static_assert(N && !(N & (N - 1)), "capacity must be a power of two");
+
+	  public:
+		spsc_queue_t() : items{}, head(0), tail(0) {}
+
+		spsc_queue_t(const spsc_queue_t&) = delete;
+		spsc_queue_t& operator=(const spsc_queue_t&) = delete;
+
+		// 队列已满时返回false
+		bool push(const T& v)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) == N)
+				return false;
+
+			items[t & (N - 1)] = v;
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		// 队列为空时返回false
+		bool pop(T* v)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire))
+				return false;
+
+			*v = items[h & (N - 1)];
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+
+		// 写入至多n个元素, 返回实际写入的个数
+		size_t push(const T* v, size_t n)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			size_t room = N - (t - head.load(std::memory_order_acquire));
+			if (n > room)
+				n = room;
+
+			for (size_t i = 0; i < n; i++)
+				items[(t + i) & (N - 1)] = v[i];
+			tail.store(t + n, std::memory_order_release);
+			return n;
+		}
+
+		// 取出至多n个元素, 返回实际取出的个数
+		size_t pop(T* v, size_t n)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			size_t len = tail.load(std::memory_order_acquire) - h;
+			if (n > len)
+				n = len;
+
+			for (size_t i = 0; i < n; i++)
+				v[i] = items[(h + i) & (N - 1)];
+			head.store(h + n, std::memory_order_release);
+			return n;
+		}
+
+		bool empty() const { return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire); }
+
+	  private:
+		T items[N];
+
+		// 读写位置分处不同的缓存行, 两个线程不会互相使对方的缓存失效
+		alignas(64) std::atomic<size_t> head;
+		alignas(64) std::atomic<size_t> tail;
+	};
+
+	// 三重缓冲
+	// 写线程总有一个可写的缓冲, 读线程总能取到最近发布的完整内容, 双方都不需要等待对方
+	template <typename T>
+	class triple_buffer_t
+	{
+	  public:
+		triple_buffer_t() : bufs{}, back(0), middle(1), front(2) {}
+
+		triple_buffer_t(const triple_buffer_t&) = delete;
+		triple_buffer_t& operator=(const triple_buffer_t&) = delete;
+
+		// 写线程当前可写的缓冲, 内容是不确定的旧数据
+		T& write_buffer() { return bufs[back]; }
+
+		// 发布写好的缓冲, 之前发布而未被读线程取走的内容被丢弃
+		void publish() { back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX; }
+
+		// 有新发布的内容时换入, 返回是否换入
+		bool acquire()
+		{
+			if (!(middle.load(std::memory_order_relaxed) & FRESH))
+				return false;
+
+			front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+			return true;
+		}
+
+		// 读线程最近换入的内容
+		const T& read_buffer() const { return bufs[front]; }
+
+	  private:
+		// middle中的低两位为缓冲的序号, FRESH表示发布后还未被取走
+		enum
+		{
+			INDEX = 3,
+			FRESH = 4,
+		};
+
+		T bufs[3];
+
+		// back归写线程, front归读线程, middle由两者交换
+		int back;
+		std::atomic<int> middle;
+		int front;
+	};
+} // namespace chip8
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace chip8
+{
+	// 执行轨迹的二进制格式
+	// 文件头为"C9TR"与u16版本号, 之后是连续的记录, 多字节数值均为小端
+	// 每条普通记录对应一个周期, 首字节tag的各位标记相对上一周期变化的字段, 字段按位从低到高依次跟随
+	// tag为TRACE_EXT的扩展记录不占用周期, 其后u8为扩展类型
+	constexpr char TRACE_MAGIC[4] = {'C', '9', 'T', 'R'};
+	constexpr word TRACE_VERSION = 1;
+
+	enum trace_tag_t : byte
+	{
+		// u16 PC, 只在PC不等于上一周期的PC+2时出现
+		TRACE_PC = 0x01,
+		// u16 IR
+		TRACE_IR = 0x02,
+		// u16 I
+		TRACE_I = 0x04,
+		// u16 变化的寄存器掩码, 之后按编号从小到大为每个变化的寄存器写u8
+		TRACE_REG = 0x08,
+		// u8 SP, SP非零时之后为u16栈顶stack[SP-1]
+		TRACE_SP = 0x10,
+		// u8 dt, u8 st
+		TRACE_TIMER = 0x20,
+		// u8 state
+		TRACE_STATE = 0x40,
+
+		TRACE_EXT = 0x80,
+	};
+
+	enum trace_ext_t : byte
+	{
+		// 完整的机器状态, 之后的记录以此为基准
+		// u64 cycles, u16 PC, u16 IR, u16 I, u8 SP, u16 stack[16], u8 reg[16], u8 dt, u8 st, u8 state, u16 keys
+		TRACE_KEYFRAME = 1,
+		// u16 keys, 在按键状态变化后的第一条记录前出现
+		TRACE_KEYS = 2,
+	};
+
+	// 每隔这么多周期写一次关键帧, 文件被截断或损坏时解码器可以从下一个关键帧继续
+	constexpr uint64_t TRACE_KEYFRAME_INTERVAL = 1 << 20;
+
+	// 轨迹中某一周期执行完毕后的机器状态
+	struct trace_state_t
+	{
+		uint64_t cycles;
+		word PC;
+		word IR;
+		word I;
+		byte SP;
+		word stack[STACK_DEEP];
+		byte reg[16];
+		byte dt;
+		byte st;
+		byte state;
+		word keys;
+	};
+
+	// 与machine_t::debug_info相同的格式, 附带周期与按键, 返回的字符串在同一线程下次调用前有效
+	const char* trace_str(const trace_state_t& s);
+
+	// 轨迹记录器
+	// 挂到machine_t::trace后, 各引擎在每个周期结束时调用record
+	// 记录先写入内存缓冲, 写满后交给后台线程写入文件, 同时切换到另一块缓冲继续记录
+	class trace_writer_t
+	{
+	  public:
+		trace_writer_t();
+		~trace_writer_t();
+
+		trace_writer_t(const trace_writer_t&) = delete;
+		trace_writer_t& operator=(const trace_writer_t&) = delete;
+
+		bool open(const char* path);
+
+		// 写出剩余的缓冲并关闭文件
+		void close();
+
+		bool is_open() const { return file != nullptr; }
+
+		// 记录刚执行完的一个周期
+		// 周期数不连续时(首次记录, reset之后等)写入关键帧
+		void record(const machine_t& m);
+
+		// 已记录的周期数
+		uint64_t records() const { return count; }
+
+	  private:
+		static constexpr size_t BUFFER_SIZE = 1 << 16;
+		// 单条记录(含按键与关键帧)的最大长度
+		static constexpr size_t MAX_RECORD = 128;
+
+		void put8(byte v) { buf[used++] = v; }
+		void put16(word v)
+		{
+			buf[used++] = (byte)v;
+			buf[used++] = (byte)(v >> 8);
+		}
+
+		void keyframe(const machine_t& m);
+
+		// 将当前缓冲交给后台线程, 后台线程仍在写上一块缓冲时等待其完成
+		void submit();
+		void writer_loop();
+
+		FILE* file;
+		uint64_t count;
+
+		// 上一周期的状态
+		trace_state_t last;
+		bool synced;
+
+		// 双缓冲, buf为正在记录的一块
+		byte* buffers[2];
+		byte* buf;
+		size_t used;
+
+		// 交给后台线程的缓冲
+		byte* pending;
+		size_t pending_len;
+		bool stopping;
+		std::mutex lock;
+		std::condition_variable cv;
+		std::thread writer;
+	};
+
+	// 轨迹解码器
+	class trace_reader_t
+	{
+	  public:
+		trace_reader_t();
+		~trace_reader_t();
+
+		trace_reader_t(const trace_reader_t&) = delete;
+		trace_reader_t& operator=(const trace_reader_t&) = delete;
+
+		// 打开文件并校验文件头
+		bool open(const char* path);
+		void close();
+
+		// 解码下一个周期, 文件结束时返回false
+		// 遇到格式错误(包括第一个关键帧之前的记录)时向后查找下一个关键帧继续
+		// 之后再没有关键帧时返回false, bad()为true
+		bool next(trace_state_t* s);
+
+		// next因格式错误而失败
+		bool bad() const { return corrupt; }
+
+		// 上一次next跳过的损坏字节数
+		// 非零时返回的是跳过之后的关键帧, 与之前的状态不连续
+		uint64_t gap() const { return gap_bytes; }
+
+	  private:
+		bool get8(byte* v);
+		bool get16(word* v);
+
+		// 从当前位置解码一条记录, 返回1为成功, 0为在记录边界上的文件尾, -1为格式错误
+		int read_record(trace_state_t* s);
+		// 读取TRACE_EXT, TRACE_KEYFRAME之后的关键帧, 字段不合法时返回false
+		bool read_keyframe();
+		// 从文件偏移from开始查找下一个能解码的关键帧, found为其偏移
+		bool resync(uint64_t from, uint64_t* found);
+
+		FILE* file;
+		// 当前的文件偏移
+		uint64_t pos;
+		trace_state_t cur;
+		bool synced;
+		bool corrupt;
+		uint64_t gap_bytes;
+	};
+} // namespace chip8
@@ -0,0 +1,62 @@
+// 静态翻译代码的运行时
+#include "aot.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <cstring>
+
+using namespace chip8;
+
+int chip8::run_aot(machine_t& m, const aot_program_t& prog, int n)
+{
+	int count = 0;
+	while (count < n)
+	{
+		// 空转时直接推进
+		if (int skipped = m.skip_idle(n - count))
+		{
+			count += skipped;
+			continue;
+		}
+
+		// 记录轨迹时逐条解释执行, 使每个周期都有记录
+		if (m.state == STATE_RUNNING && !m.trace && m.PC < MEM_SIZE)
+		{
+			const aot_block_t* b = prog.find(m.PC);
+			int len = b ? b->len / 2 : 0;
+			if (b && len <= n - count && (uint64_t)len <= m.next_tick - m.cycles &&
+				std::memcmp(m.ram + b->addr, b->code, b->len) == 0)
+			{
+				if (m.profile)
+					m.profile->count_block(m, b->addr, len);
+				b->fn(m);
+				count += len;
+				m.advance(len);
+				continue;
+			}
+		}
+
+		if (m.state == STATE_RUNNING)
+		{
+			m.fetch();
+			if (m.profile)
+				m.profile->count(m, m.PC - 2, m.IR);
+		}
+		// 等待按键或垂直消隐时交给参考实现处理
+		else if (!m.waiting())
+			break;
+		else if (m.profile && m.state == STATE_WAIT_KEY)
+			m.profile->count_wait();
+
+		m.execute();
+		count++;
+		m.advance(1);
+
+		if (m.trace)
+			m.trace->record(m);
+
+		if (m.halted())
+			break;
+	}
+	return count;
+}
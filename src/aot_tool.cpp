@@ -0,0 +1,389 @@
+// chip9-aot: 将卡带静态翻译为c++翻译单元
+// 用法: chip9-aot <rom> <out.cpp> [symbol]
+// 从0x200开始沿控制流遍历可达的指令, 为每个基本块生成一个函数, 生成的文件与chip8core一同编译
+// 之后以chip8::run_aot(machine, symbol, n)代替解释器执行
+#include "chip8.h"
+#include "common.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace chip8;
+
+// 单个基本块的最大指令数
+constexpr int MAX_BLOCK_INSTR = 64;
+
+// 指令在基本块中的角色
+enum op_kind_t
+{
+	// 可内联翻译, 之后继续顺序执行
+	OP_BODY,
+	// 可翻译的控制流指令, 结束基本块
+	OP_EXIT,
+	// 交由解释器执行, 结束基本块
+	OP_INTERP,
+};
+
+struct rom_t
+{
+	byte dat[MEM_SIZE];
+	int len;
+
+	bool contains(int addr) const { return addr >= PROG_MEM_OFFSET && addr + 1 < PROG_MEM_OFFSET + len; }
+	word at(int addr) const
+	{
+		return (word)((dat[addr - PROG_MEM_OFFSET] << 8) | dat[addr + 1 - PROG_MEM_OFFSET]);
+	}
+};
+
+static op_kind_t classify(word ir, word pc)
+{
+	switch (ir & 0xF000)
+	{
+		case 0x0000:
+			return ir == 0x00EE ? OP_EXIT : OP_INTERP;
+		case 0x1000:
+			// 自跳转交由解释器报告死循环
+			return (ir & 0x0FFF) == pc ? OP_INTERP : OP_EXIT;
+		case 0x2000:
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x9000:
+			return OP_EXIT;
+		case 0x6000:
+		case 0x7000:
+		case 0xA000:
+			return OP_BODY;
+		case 0x8000:
+			switch (ir & 0x000F)
+			{
+				case 0:
+				case 1:
+				case 2:
+				case 3:
+				case 4:
+				case 5:
+				case 6:
+				case 7:
+				case 0xE:
+					return OP_BODY;
+				default:
+					return OP_INTERP;
+			}
+		case 0xF000:
+			switch (ir & 0xF0FF)
+			{
+				case 0xF007:
+				case 0xF015:
+				case 0xF018:
+				case 0xF01E:
+				case 0xF029:
+				case 0xF065:
+					return OP_BODY;
+				default:
+					return OP_INTERP;
+			}
+		default:
+			return OP_INTERP;
+	}
+}
+
+// 指令执行后静态可知的后继地址
+// 返回false表示后继无法静态确定或执行将停止
+static bool successors(word ir, word pc, std::vector<int>& out)
+{
+	word next = pc + 2;
+	switch (ir & 0xF000)
+	{
+		case 0x0000:
+			// 00E0继续执行, 00EE的返回地址由调用处记录
+			if (ir == 0x00E0)
+				out.push_back(next);
+			return ir == 0x00E0 || ir == 0x00EE;
+		case 0x1000:
+			out.push_back(ir & 0x0FFF);
+			return true;
+		case 0x2000:
+			out.push_back(ir & 0x0FFF);
+			out.push_back(next);
+			return true;
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x9000:
+		case 0xE000:
+			out.push_back(next);
+			out.push_back(next + 2);
+			return true;
+		case 0xB000:
+			return false;
+		default:
+			out.push_back(next);
+			return true;
+	}
+}
+
+// 生成单条内联指令
+static void emit_body(FILE* f, word ir)
+{
+	int x = (ir & 0x0F00) >> 8;
+	int y = (ir & 0x00F0) >> 4;
+	int nn = ir & 0x00FF;
+	int nnn = ir & 0x0FFF;
+
+	switch (ir & 0xF000)
+	{
+		case 0x6000:
+			std::fprintf(f, "\tm.reg[%d] = 0x%02X;\n", x, nn);
+			return;
+		case 0x7000:
+			std::fprintf(f, "\tm.reg[%d] += 0x%02X;\n", x, nn);
+			return;
+		case 0xA000:
+			std::fprintf(f, "\tm.I = 0x%03X;\n", nnn);
+			return;
+		case 0x8000: {
+			static const char* logic_op[] = {"|", "&", "^"};
+			switch (ir & 0x000F)
+			{
+				case 0:
+					std::fprintf(f, "\tm.reg[%d] = m.reg[%d];\n", x, y);
+					return;
+				case 1:
+				case 2:
+				case 3:
+					std::fprintf(f, "\tm.reg[%d] %s= m.reg[%d];\n\tm.reg[15] = 0;\n", x, logic_op[(ir & 0xF) - 1], y);
+					return;
+				case 4:
+					std::fprintf(f,
+						"\t{\n\t\tint v = m.reg[%d] + m.reg[%d];\n\t\tm.reg[%d] = (byte)v;\n\t\tm.reg[15] = v > 0xFF;\n\t}\n",
+						x, y, x);
+					return;
+				case 5:
+					std::fprintf(f,
+						"\t{\n\t\tbyte a = m.reg[%d], b = m.reg[%d];\n\t\tm.reg[%d] = a - b;\n\t\tm.reg[15] = a >= b;\n\t}\n",
+						x, y, x);
+					return;
+				case 6:
+					std::fprintf(f, "\t{\n\t\tbyte a = m.reg[%d];\n\t\tm.reg[%d] = a >> 1;\n\t\tm.reg[15] = a & 1;\n\t}\n", x,
+						x);
+					return;
+				case 7:
+					std::fprintf(f,
+						"\t{\n\t\tbyte a = m.reg[%d], b = m.reg[%d];\n\t\tm.reg[%d] = b - a;\n\t\tm.reg[15] = b >= a;\n\t}\n",
+						x, y, x);
+					return;
+				case 0xE:
+					std::fprintf(f,
+						"\t{\n\t\tbyte a = m.reg[%d];\n\t\tm.reg[%d] = a << 1;\n\t\tm.reg[15] = (a & 0x80) != 0;\n\t}\n", x,
+						x);
+					return;
+			}
+			return;
+		}
+		default:
+			switch (ir & 0xF0FF)
+			{
+				case 0xF007:
+					std::fprintf(f, "\tm.reg[%d] = m.dt;\n", x);
+					return;
+				case 0xF015:
+					std::fprintf(f, "\tm.dt = m.reg[%d];\n", x);
+					return;
+				case 0xF018:
+					std::fprintf(f, "\tm.st = m.reg[%d];\n", x);
+					return;
+				case 0xF01E:
+					std::fprintf(f, "\tm.I += m.reg[%d];\n", x);
+					return;
+				case 0xF029:
+					std::fprintf(f, "\tm.I = m.font_mem_offset + (m.reg[%d] & 0xF) * 4;\n", x);
+					return;
+				case 0xF065:
+					for (int i = 0; i <= x; i++)
+						std::fprintf(f, "\tm.reg[%d] = m.ram[(m.I + %d) & 0xFFF];\n", i, i);
+					std::fprintf(f, "\tm.I += %d;\n", x);
+					return;
+			}
+	}
+}
+
+// 生成作为出口的控制流指令, k为基本块执行的指令数
+static void emit_exit(FILE* f, word ir, word pc, int k)
+{
+	int x = (ir & 0x0F00) >> 8;
+	int y = (ir & 0x00F0) >> 4;
+	int nn = ir & 0x00FF;
+	int nnn = ir & 0x0FFF;
+	int next = pc + 2;
+
+	std::fprintf(f, "\tm.IR = 0x%04X;\n", ir);
+	switch (ir & 0xF000)
+	{
+		case 0x0000:
+			std::fprintf(f, "\tif (m.SP == 0)\n\t{\n\t\tm.PC = 0x%03X;\n\t\tm.state = STATE_ERROR_POP_EMPTY_STAKC;\n", next);
+			std::fprintf(f, "\t\treturn %d;\n\t}\n\tm.SP--;\n\tm.PC = m.stack[m.SP];\n", k);
+			break;
+		case 0x1000:
+			std::fprintf(f, "\tm.PC = 0x%03X;\n", nnn);
+			break;
+		case 0x2000:
+			std::fprintf(f, "\tm.PC = 0x%03X;\n\tif (m.SP >= STACK_DEEP)\n\t{\n", next);
+			std::fprintf(f, "\t\tm.state = STATE_ERROR_STAKE_FULL;\n\t\treturn %d;\n\t}\n", k);
+			std::fprintf(f, "\tm.stack[m.SP++] = 0x%03X;\n\tm.PC = 0x%03X;\n", next, nnn);
+			break;
+		case 0x3000:
+			std::fprintf(f, "\tm.PC = m.reg[%d] == 0x%02X ? 0x%03X : 0x%03X;\n", x, nn, next + 2, next);
+			break;
+		case 0x4000:
+			std::fprintf(f, "\tm.PC = m.reg[%d] != 0x%02X ? 0x%03X : 0x%03X;\n", x, nn, next + 2, next);
+			break;
+		case 0x5000:
+			std::fprintf(f, "\tm.PC = m.reg[%d] == m.reg[%d] ? 0x%03X : 0x%03X;\n", x, y, next + 2, next);
+			break;
+		case 0x9000:
+			std::fprintf(f, "\tm.PC = m.reg[%d] != m.reg[%d] ? 0x%03X : 0x%03X;\n", x, y, next + 2, next);
+			break;
+	}
+	std::fprintf(f, "\treturn %d;\n", k);
+}
+
+// 由文件名生成符号名
+static std::string make_symbol(const char* path)
+{
+	const char* name = std::strrchr(path, '/');
+	const char* alt = std::strrchr(path, '\\');
+	if (alt && (!name || alt > name))
+		name = alt;
+	name = name ? name + 1 : path;
+
+	std::string sym = "aot_";
+	for (const char* c = name; *c && *c != '.'; c++)
+		sym += std::isalnum((unsigned char)*c) ? *c : '_';
+	return sym;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::printf("usage: %s <rom> <out.cpp> [symbol]\n", argv[0]);
+		return 1;
+	}
+
+	static rom_t rom{};
+	rom.len = MEM_SIZE - PROG_MEM_OFFSET;
+	if (!load_file(argv[1], rom.dat, &rom.len))
+		return 1;
+
+	std::string symbol = argc > 3 ? argv[3] : make_symbol(argv[1]);
+
+	// 遍历控制流, 记录所有基本块的起点
+	std::set<int> leaders;
+	std::set<int> visited;
+	std::vector<int> work{PROG_MEM_OFFSET};
+	while (!work.empty())
+	{
+		int pc = work.back();
+		work.pop_back();
+		if (!rom.contains(pc) || visited.count(pc))
+			continue;
+		visited.insert(pc);
+
+		word ir = rom.at(pc);
+		std::vector<int> next;
+		successors(ir, pc, next);
+		for (int n : next)
+			work.push_back(n);
+
+		// 控制流转移的目标与解释执行后的下一条指令都是基本块的起点
+		bool seq = next.size() == 1 && next[0] == pc + 2;
+		if (pc == PROG_MEM_OFFSET)
+			leaders.insert(pc);
+		if (!seq || classify(ir, pc) != OP_BODY)
+			for (int n : next)
+				leaders.insert(n);
+	}
+
+	FILE* f = std::fopen(argv[2], "w");
+	if (!f)
+	{
+		std::printf("Error: Could not open %s\n", argv[2]);
+		return 1;
+	}
+
+	std::fprintf(f, "// generated by chip9-aot from %s, do not edit\n", argv[1]);
+	std::fprintf(f, "#include \"aot.h\"\n\nusing namespace chip8;\n\n");
+
+	std::vector<int> blocks;
+	for (int start : leaders)
+	{
+		if (!rom.contains(start))
+			continue;
+
+		// 收集基本块中的指令
+		std::vector<word> ops;
+		int pc = start;
+		bool exited = false;
+		while (rom.contains(pc) && (int)ops.size() < MAX_BLOCK_INSTR)
+		{
+			word ir = rom.at(pc);
+			op_kind_t kind = classify(ir, (word)pc);
+			if (kind == OP_INTERP)
+				break;
+
+			ops.push_back(ir);
+			pc += 2;
+			if (kind == OP_EXIT)
+			{
+				exited = true;
+				break;
+			}
+		}
+		if (ops.empty())
+			continue;
+
+		int len = pc - start;
+		std::fprintf(f, "static const byte code_%03X[] = {", start);
+		for (int i = 0; i < len; i++)
+			std::fprintf(f, "%s0x%02X", i ? ", " : "", rom.dat[start - PROG_MEM_OFFSET + i]);
+		std::fprintf(f, "};\n\n");
+
+		std::fprintf(f, "static int blk_%03X(machine_t& m)\n{\n", start);
+		int k = (int)ops.size();
+		for (int i = 0; i < k; i++)
+		{
+			if (exited && i == k - 1)
+				emit_exit(f, ops[i], (word)(start + i * 2), k);
+			else
+				emit_body(f, ops[i]);
+		}
+		if (!exited)
+			std::fprintf(f, "\tm.IR = 0x%04X;\n\tm.PC = 0x%03X;\n\treturn %d;\n", ops.back(), pc, k);
+		std::fprintf(f, "}\n\n");
+
+		blocks.push_back(start);
+		blocks.push_back(len);
+	}
+
+	std::fprintf(f, "static const aot_block_t blocks[] = {\n");
+	for (size_t i = 0; i < blocks.size(); i += 2)
+		std::fprintf(f, "\t{0x%03X, %d, code_%03X, blk_%03X},\n", blocks[i], blocks[i + 1], blocks[i], blocks[i]);
+	std::fprintf(f, "\t{0, 0, nullptr, nullptr},\n};\n\n");
+
+	std::fprintf(f, "static const aot_block_t* find(word addr)\n{\n\tswitch (addr)\n\t{\n");
+	for (size_t i = 0; i < blocks.size(); i += 2)
+		std::fprintf(f, "\t\tcase 0x%03X:\n\t\t\treturn &blocks[%zu];\n", blocks[i], i / 2);
+	std::fprintf(f, "\t\tdefault:\n\t\t\treturn nullptr;\n\t}\n}\n\n");
+
+	std::fprintf(f, "extern const aot_program_t %s = {\"%s\", find};\n", symbol.c_str(), symbol.c_str());
+	std::fclose(f);
+
+	std::printf("%s: %zu blocks written to %s as %s\n", argv[1], blocks.size() / 2, argv[2], symbol.c_str());
+	return 0;
+}
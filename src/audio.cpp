@@ -0,0 +1,83 @@
+#include "audio.h"
+
+#include <cstdio>
+
+using namespace chip8;
+
+tone_t::tone_t(int sample_rate, int tone_hz) : rate(sample_rate), frac(0), phase(0)
+{
+	if (rate <= 0 || rate / 60 >= MAX_FRAME_SAMPLES)
+		rate = DEFAULT_SAMPLE_RATE;
+	step = (uint32_t)(((uint64_t)tone_hz << 32) / (uint64_t)rate);
+}
+
+int tone_t::render_frame(bool on, int16_t* out)
+{
+	int n = rate / 60;
+	frac += rate % 60;
+	if (frac >= 60)
+	{
+		frac -= 60;
+		n++;
+	}
+
+	// 静音时相位保持不动, 下次发声从同一位置继续
+	if (!on)
+	{
+		for (int i = 0; i < n; i++)
+			out[i] = 0;
+		return n;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		out[i] = phase & 0x80000000u ? -TONE_AMPLITUDE : TONE_AMPLITUDE;
+		phase += step;
+	}
+	return n;
+}
+
+// 小端写入
+static void put_le(FILE* f, uint32_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		std::fputc((int)((v >> (i * 8)) & 0xFF), f);
+}
+
+bool chip8::write_wav(const char* path, const int16_t* samples, size_t n, int sample_rate)
+{
+	FILE* f = std::fopen(path, "wb");
+	if (!f)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	uint32_t data_len = (uint32_t)(n * 2);
+
+	std::fwrite("RIFF", 1, 4, f);
+	put_le(f, 36 + data_len, 4);
+	std::fwrite("WAVE", 1, 4, f);
+
+	// PCM, 单声道, 16位
+	std::fwrite("fmt ", 1, 4, f);
+	put_le(f, 16, 4);
+	put_le(f, 1, 2);
+	put_le(f, 1, 2);
+	put_le(f, (uint32_t)sample_rate, 4);
+	put_le(f, (uint32_t)sample_rate * 2, 4);
+	put_le(f, 2, 2);
+	put_le(f, 16, 2);
+
+	std::fwrite("data", 1, 4, f);
+	put_le(f, data_len, 4);
+	for (size_t i = 0; i < n; i++)
+		put_le(f, (uint16_t)samples[i], 2);
+
+	bool ok = !std::ferror(f);
+	if (std::fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		std::printf("Error: Could not write %s\n", path);
+	return ok;
+}
@@ -0,0 +1,61 @@
+#include "common.h"
+#include "spsc.h"
+
+#include <SDL3/SDL.h>
+#include <cstdint>
+#include <cstdio>
+
+// 模拟线程写入, sdl的音频线程读出, 约90ms
+static chip8::spsc_queue_t<int16_t, 4096> audio_ring;
+static SDL_AudioStream* audio_stream = nullptr;
+
+// 由sdl的音频线程调用, 采样不足时补静音, 从不等待模拟线程
+static void SDLCALL feed_audio(void*, SDL_AudioStream* stream, int additional_amount, int)
+{
+	int16_t buf[512];
+	int need = additional_amount / (int)sizeof(int16_t);
+	while (need > 0)
+	{
+		int n = need < 512 ? need : 512;
+		int got = (int)audio_ring.pop(buf, (size_t)n);
+		for (int i = got; i < n; i++)
+			buf[i] = 0;
+		SDL_PutAudioStreamData(stream, buf, n * (int)sizeof(int16_t));
+		need -= n;
+	}
+}
+
+bool audio_open(int sample_rate)
+{
+	if (!SDL_InitSubSystem(SDL_INIT_AUDIO))
+	{
+		std::printf("Error: Could not init audio: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_AudioSpec spec{SDL_AUDIO_S16, 1, sample_rate};
+	audio_stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, feed_audio, nullptr);
+	if (!audio_stream)
+	{
+		std::printf("Error: Could not open audio device: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_ResumeAudioStreamDevice(audio_stream);
+	return true;
+}
+
+void audio_close()
+{
+	if (audio_stream)
+		SDL_DestroyAudioStream(audio_stream);
+	audio_stream = nullptr;
+}
+
+void audio_queue(const int16_t* samples, int n) { audio_ring.push(samples, (size_t)n); }
+
+uint64_t uptime_ns() { return SDL_GetTicksNS(); }
+uint64_t uptime_ms() { return SDL_GetTicks(); }
+
+void delay_ms(uint32_t ms) { SDL_Delay(ms); }
+void delay_ns(uint32_t ns) { SDL_DelayNS(ns); }
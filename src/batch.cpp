@@ -0,0 +1,732 @@
+// 步调一致的批量解释器
+// 指令语义与machine_t::execute保持一致
+#include "batch.h"
+
+#include <cstring>
+
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define BATCH_SSE2 1
+#endif
+
+using namespace chip8;
+
+constexpr word ADDR_MASK = MEM_SIZE - 1;
+
+static inline int lowest_bit(uint32_t v)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return (int)i;
+#else
+	return __builtin_ctz(v);
+#endif
+}
+
+static inline int bit_count(uint32_t v)
+{
+#ifdef _MSC_VER
+	return (int)__popcnt(v);
+#else
+	return __builtin_popcount(v);
+#endif
+}
+
+static_assert(BATCH_LANES % 16 == 0, "lanes are processed 16 at a time");
+
+#ifdef BATCH_SSE2
+
+// PC等于pc的机器
+static inline uint32_t match_pc(const word* pcs, word pc)
+{
+	const __m128i p = _mm_set1_epi16((short)pc);
+	uint32_t mask = 0;
+	for (int i = 0; i < BATCH_LANES; i += 16)
+	{
+		__m128i lo = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(pcs + i)), p);
+		__m128i hi = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(pcs + i + 8)), p);
+		mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << i;
+	}
+	return mask;
+}
+
+// 把每台机器一位的掩码展开为每台一字节
+static inline void expand_mask(uint32_t mask, byte* on)
+{
+	const __m128i select = _mm_set_epi8((char)128, 64, 32, 16, 8, 4, 2, 1, (char)128, 64, 32, 16, 8, 4, 2, 1);
+	for (int i = 0; i < BATCH_LANES; i += 16)
+	{
+		uint64_t lo = (mask >> i) & 0xFF;
+		uint64_t hi = (mask >> (i + 8)) & 0xFF;
+		__m128i bits = _mm_set_epi64x((long long)(hi * 0x0101010101010101ull), (long long)(lo * 0x0101010101010101ull));
+		_mm_store_si128((__m128i*)(on + i), _mm_cmpeq_epi8(_mm_and_si128(bits, select), select));
+	}
+}
+
+// 每台一字节的掩码中非零的机器
+static inline uint32_t collect_mask(const byte* on)
+{
+	uint32_t mask = 0;
+	for (int i = 0; i < BATCH_LANES; i += 16)
+	{
+		__m128i v = _mm_load_si128((const __m128i*)(on + i));
+		mask |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) << i;
+	}
+	return ~mask;
+}
+
+#else
+
+static inline uint32_t match_pc(const word* pcs, word pc)
+{
+	uint32_t mask = 0;
+	for (int l = 0; l < BATCH_LANES; l++)
+		mask |= (uint32_t)(pcs[l] == pc) << l;
+	return mask;
+}
+
+static inline void expand_mask(uint32_t mask, byte* on)
+{
+	for (int l = 0; l < BATCH_LANES; l++)
+		on[l] = (byte)(0 - ((mask >> l) & 1));
+}
+
+static inline uint32_t collect_mask(const byte* on)
+{
+	uint32_t mask = 0;
+	for (int l = 0; l < BATCH_LANES; l++)
+		mask |= (uint32_t)(on[l] != 0) << l;
+	return mask;
+}
+
+#endif
+
+// 执行后各机器的PC可能不同的指令
+static bool diverging_op(word ir)
+{
+	switch (ir & 0xF000)
+	{
+		case 0x0000:
+			return ir == 0x00EE;
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x9000:
+		case 0xB000:
+		case 0xE000:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// 可以共享解码执行的指令, 其余的(FX0A与无效指令)逐台交给参考实现
+static bool shared_op(word ir)
+{
+	switch (ir & 0xF000)
+	{
+		case 0x0000:
+			return ir == 0x00E0 || ir == 0x00EE;
+		case 0x5000:
+		case 0x9000:
+			return (ir & 0xF) == 0;
+		case 0x8000: {
+			word op = ir & 0xF;
+			return op <= 7 || op == 0xE;
+		}
+		case 0xE000:
+			return (ir & 0xFF) == 0x9E || (ir & 0xFF) == 0xA1;
+		case 0xF000: {
+			switch (ir & 0xFF)
+			{
+				case 0x07:
+				case 0x15:
+				case 0x18:
+				case 0x1E:
+				case 0x29:
+				case 0x33:
+				case 0x55:
+				case 0x65:
+					return true;
+				default:
+					return false;
+			}
+		}
+		default:
+			return true;
+	}
+}
+
+batch_t::batch_t()
+	: shared_steps(0), single_steps(0), V{}, I{}, PC{}, IR{}, dt{}, st{}, lanes(nullptr), count(0), active(0),
+	  running(0), clock{}, code{}, written{}
+{
+}
+
+bool batch_t::load(machine_t* machines, int n)
+{
+	if (n <= 0 || n > BATCH_LANES)
+		return false;
+
+	// 停机的机器不再运行, 不要求时钟相同
+	int lead = 0;
+	while (lead < n - 1 && machines[lead].halted())
+		lead++;
+
+	const machine_t& first = machines[lead];
+	for (int l = 0; l < n; l++)
+	{
+		const machine_t& m = machines[l];
+		if (m.profile || m.trace)
+			return false;
+		if (!m.halted() && (m.cycles != first.cycles || m.ticks != first.ticks || m.next_tick != first.next_tick ||
+							   m.ips != first.ips || m.tick_frac != first.tick_frac))
+			return false;
+	}
+
+	lanes = machines;
+	count = n;
+
+	clock.cycles = first.cycles;
+	clock.ticks = first.ticks;
+	clock.next_tick = first.next_tick;
+	clock.ips = first.ips;
+	clock.tick_frac = first.tick_frac;
+	clock.state = STATE_RUNNING;
+
+	// 各机器内容不同的地址视同被写入过
+	std::memcpy(code, first.ram, MEM_SIZE);
+	std::memset(written, 0, sizeof(written));
+	for (int l = 0; l < n; l++)
+	{
+		for (int a = 0; a < MEM_SIZE; a++)
+			written[a] |= machines[l].ram[a] != code[a];
+	}
+
+	active = 0;
+	running = 0;
+	for (int l = 0; l < n; l++)
+	{
+		gather(l);
+		if (!lanes[l].halted())
+			active |= 1u << l;
+		update_state(l);
+	}
+
+	shared_steps = 0;
+	single_steps = 0;
+	return true;
+}
+
+void batch_t::gather(int l)
+{
+	const machine_t& m = lanes[l];
+	for (int r = 0; r < 16; r++)
+		V[r][l] = m.reg[r];
+	I[l] = m.I;
+	PC[l] = m.PC;
+	IR[l] = m.IR;
+	dt[l] = m.dt;
+	st[l] = m.st;
+}
+
+void batch_t::scatter(int l)
+{
+	machine_t& m = lanes[l];
+	for (int r = 0; r < 16; r++)
+		m.reg[r] = V[r][l];
+	m.I = I[l];
+	m.PC = PC[l];
+	m.IR = IR[l];
+	m.dt = dt[l];
+	m.st = st[l];
+}
+
+void batch_t::update_state(int l)
+{
+	if (lanes[l].state == STATE_RUNNING)
+		running |= 1u << l;
+	else
+		running &= ~(1u << l);
+}
+
+void batch_t::mark_written(word addr, int len)
+{
+	for (int i = 0; i < len; i++)
+		written[(addr + i) & ADDR_MASK] = 1;
+}
+
+void batch_t::store()
+{
+	for (uint32_t w = active; w; w &= w - 1)
+	{
+		int l = lowest_bit(w);
+		machine_t& m = lanes[l];
+		scatter(l);
+		m.cycles = clock.cycles;
+		m.ticks = clock.ticks;
+		m.next_tick = clock.next_tick;
+		m.tick_frac = clock.tick_frac;
+	}
+}
+
+int batch_t::run(int n)
+{
+	int done = 0;
+	while (done < n && active)
+	{
+		// 不跨过计时器递减
+		uint64_t left = (uint64_t)(n - done);
+		if (clock.next_tick - clock.cycles < left)
+			left = clock.next_tick - clock.cycles;
+
+		// 所有机器都在同一PC上运行时连续共享执行, 否则按PC分组执行一个周期
+		int k = 0;
+		if (running == active && (match_pc(PC, PC[lowest_bit(running)]) & running) == running)
+			k = run_shared((int)left);
+		if (!k)
+		{
+			step_cycle();
+			k = 1;
+		}
+		done += k;
+
+		// 推进共享的时钟, 停机的机器也要经过停机所在周期的计时器递减
+		uint64_t ticks = clock.ticks;
+		clock.advance(k);
+		for (; ticks < clock.ticks; ticks++)
+			update_timers();
+
+		// 停机的机器写回并停在这一周期
+		for (uint32_t w = active & ~running; w; w &= w - 1)
+		{
+			int l = lowest_bit(w);
+			if (!lanes[l].halted())
+				continue;
+
+			active &= ~(1u << l);
+			scatter(l);
+			lanes[l].cycles = clock.cycles;
+			lanes[l].ticks = clock.ticks;
+			lanes[l].next_tick = clock.next_tick;
+			lanes[l].tick_frac = clock.tick_frac;
+		}
+	}
+	return done;
+}
+
+int batch_t::run_shared(int n)
+{
+	const uint32_t group = running;
+	word pc = PC[lowest_bit(group)];
+
+	int k = 0;
+	while (k < n)
+	{
+		// 被写入过的地址上各机器的指令可能不同
+		if (pc > MEM_SIZE - 2 || written[pc] || written[pc + 1])
+			break;
+		word ir = (word)(code[pc] << 8 | code[pc + 1]);
+		if (!shared_op(ir))
+			break;
+
+		execute(group, ir);
+		shared_steps += (uint64_t)bit_count(group);
+		k++;
+
+		// 停机, 等待或PC分歧之后回到按PC分组执行
+		if (running != group)
+			break;
+		pc = PC[lowest_bit(group)];
+		if (diverging_op(ir) && (match_pc(PC, pc) & group) != group)
+			break;
+	}
+	return k;
+}
+
+void batch_t::step_cycle()
+{
+	// 等待按键或垂直消隐的机器逐台执行, 本周期内结束等待的机器不再取指
+	uint32_t pending = running;
+	for (uint32_t w = active & ~running; w; w &= w - 1)
+		step_single(lowest_bit(w));
+
+	// 按PC分组
+	while (pending)
+	{
+		word pc = PC[lowest_bit(pending)];
+
+		uint32_t group = match_pc(PC, pc) & pending;
+		pending &= ~group;
+
+		if (pc > MEM_SIZE - 2 || written[pc] || written[pc + 1])
+		{
+			for (uint32_t w = group; w; w &= w - 1)
+				step_single(lowest_bit(w));
+		}
+		else
+			step_group(group, (word)(code[pc] << 8 | code[pc + 1]));
+	}
+}
+
+void batch_t::update_timers()
+{
+	alignas(32) byte on[BATCH_LANES];
+	alignas(32) byte sound[BATCH_LANES];
+	expand_mask(active, on);
+
+	// 非零的计时器减一
+	for (int l = 0; l < BATCH_LANES; l++)
+	{
+		sound[l] = st[l] ? on[l] : 0;
+		st[l] -= sound[l] & 1;
+		dt[l] -= (dt[l] ? on[l] : 0) & 1;
+	}
+	for (uint32_t w = collect_mask(sound); w; w &= w - 1)
+		lanes[lowest_bit(w)].sound_ticks++;
+
+	for (uint32_t w = active & ~running; w; w &= w - 1)
+	{
+		int l = lowest_bit(w);
+		if (lanes[l].state == STATE_WAIT_VBLANK)
+		{
+			lanes[l].state = STATE_RUNNING;
+			update_state(l);
+		}
+	}
+}
+
+void batch_t::step_single(int l)
+{
+	machine_t& m = lanes[l];
+	scatter(l);
+
+	if (m.state == STATE_RUNNING)
+		m.fetch();
+
+	// FX33与FX55写入内存
+	if (m.state == STATE_RUNNING && (m.IR & 0xF0FF) == 0xF033)
+		mark_written(m.I, 3);
+	else if (m.state == STATE_RUNNING && (m.IR & 0xF0FF) == 0xF055)
+		mark_written(m.I, ((m.IR >> 8) & 0xF) + 1);
+
+	m.execute();
+
+	gather(l);
+	update_state(l);
+	single_steps++;
+}
+
+void batch_t::step_group(uint32_t group, word ir)
+{
+	if (!shared_op(ir))
+	{
+		for (uint32_t w = group; w; w &= w - 1)
+			step_single(lowest_bit(w));
+		return;
+	}
+
+	execute(group, ir);
+	shared_steps += (uint64_t)bit_count(group);
+}
+
+void batch_t::execute(uint32_t mask, word ir)
+{
+	// 只处理有机器的16台一组
+	for (int base = 0; base < BATCH_LANES; base += 16)
+	{
+		uint32_t part = mask & (0xFFFFu << base);
+		if (part)
+			execute_lanes(base, part, ir);
+	}
+}
+
+void batch_t::execute_lanes(int base, uint32_t mask, word ir)
+{
+	const int x = (ir >> 8) & 0xF;
+	const int y = (ir >> 4) & 0xF;
+	const byte nn = (byte)(ir & 0xFF);
+	const word nnn = (word)(ir & 0xFFF);
+
+	// 每台机器一个字节的掩码, 使简单的指令可以写成无分支的混合
+	alignas(32) byte on[BATCH_LANES];
+	expand_mask(mask, on);
+
+	for (int l = base; l < base + 16; l++)
+	{
+		IR[l] = on[l] ? ir : IR[l];
+		PC[l] += 2 & on[l];
+	}
+
+	byte* vx = V[x];
+	byte* vy = V[y];
+	byte* vf = V[0xF];
+
+	switch (ir & 0xF000)
+	{
+		case 0x0000: {
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				machine_t& m = lanes[l];
+
+				// 00E0: 清屏
+				if (ir == 0x00E0)
+					m.clear_vram();
+				// 00EE: 弹出栈顶地址
+				else if (m.SP == 0)
+				{
+					m.state = STATE_ERROR_POP_EMPTY_STAKC;
+					update_state(l);
+				}
+				else
+					PC[l] = m.stack[--m.SP];
+			}
+			return;
+		}
+		// 1NNN: 跳转, 跳转到自身时停机
+		case 0x1000: {
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				if (nnn == PC[l] - 2)
+				{
+					lanes[l].state = STATE_INFINITE_LOOP;
+					update_state(l);
+				}
+				else
+					PC[l] = nnn;
+			}
+			return;
+		}
+		// 2NNN: 调用
+		case 0x2000: {
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				machine_t& m = lanes[l];
+				if (m.SP >= STACK_DEEP)
+				{
+					m.state = STATE_ERROR_STAKE_FULL;
+					update_state(l);
+					continue;
+				}
+				m.stack[m.SP++] = PC[l];
+				PC[l] = nnn;
+			}
+			return;
+		}
+		// 3XNN, 4XNN, 5XY0, 9XY0: 条件跳过
+		case 0x3000: {
+			for (int l = base; l < base + 16; l++)
+				PC[l] += (vx[l] == nn ? 2 : 0) & on[l];
+			return;
+		}
+		case 0x4000: {
+			for (int l = base; l < base + 16; l++)
+				PC[l] += (vx[l] != nn ? 2 : 0) & on[l];
+			return;
+		}
+		case 0x5000: {
+			for (int l = base; l < base + 16; l++)
+				PC[l] += (vx[l] == vy[l] ? 2 : 0) & on[l];
+			return;
+		}
+		case 0x9000: {
+			for (int l = base; l < base + 16; l++)
+				PC[l] += (vx[l] != vy[l] ? 2 : 0) & on[l];
+			return;
+		}
+		// 6XNN: Vx=NN
+		case 0x6000: {
+			for (int l = base; l < base + 16; l++)
+				vx[l] = (byte)((nn & on[l]) | (vx[l] & ~on[l]));
+			return;
+		}
+		// 7XNN: Vx+=NN
+		case 0x7000: {
+			for (int l = base; l < base + 16; l++)
+				vx[l] = (byte)(vx[l] + (nn & on[l]));
+			return;
+		}
+		// 8XY_: 先写Vx再写VF, x为F时以标志为准
+		case 0x8000: {
+			byte r[BATCH_LANES];
+			byte f[BATCH_LANES];
+			switch (ir & 0xF)
+			{
+				case 0:
+					for (int l = base; l < base + 16; l++)
+						vx[l] = (byte)((vy[l] & on[l]) | (vx[l] & ~on[l]));
+					return;
+				case 1:
+					for (int l = base; l < base + 16; l++)
+						r[l] = vx[l] | vy[l], f[l] = 0;
+					break;
+				case 2:
+					for (int l = base; l < base + 16; l++)
+						r[l] = vx[l] & vy[l], f[l] = 0;
+					break;
+				case 3:
+					for (int l = base; l < base + 16; l++)
+						r[l] = vx[l] ^ vy[l], f[l] = 0;
+					break;
+				case 4:
+					for (int l = base; l < base + 16; l++)
+						r[l] = (byte)(vx[l] + vy[l]), f[l] = vx[l] + vy[l] > 0xFF;
+					break;
+				case 5:
+					for (int l = base; l < base + 16; l++)
+						r[l] = (byte)(vx[l] - vy[l]), f[l] = vx[l] >= vy[l];
+					break;
+				case 6:
+					for (int l = base; l < base + 16; l++)
+						r[l] = vx[l] >> 1, f[l] = vx[l] & 1;
+					break;
+				case 7:
+					for (int l = base; l < base + 16; l++)
+						r[l] = (byte)(vy[l] - vx[l]), f[l] = vy[l] >= vx[l];
+					break;
+				default: // 0xE
+					for (int l = base; l < base + 16; l++)
+						r[l] = (byte)(vx[l] << 1), f[l] = vx[l] >> 7;
+					break;
+			}
+			for (int l = base; l < base + 16; l++)
+				vx[l] = (byte)((r[l] & on[l]) | (vx[l] & ~on[l]));
+			for (int l = base; l < base + 16; l++)
+				vf[l] = (byte)((f[l] & on[l]) | (vf[l] & ~on[l]));
+			return;
+		}
+		// ANNN: I=NNN
+		case 0xA000: {
+			for (int l = base; l < base + 16; l++)
+				I[l] = on[l] ? nnn : I[l];
+			return;
+		}
+		// BNNN: 跳转到V0+NNN
+		case 0xB000: {
+			for (int l = base; l < base + 16; l++)
+				PC[l] += (word)((V[0][l] + nnn) & (0 - (on[l] & 1)));
+			return;
+		}
+		// CXNN: 各机器有自己的随机数状态
+		case 0xC000: {
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				vx[l] = nn & lanes[l].random();
+			}
+			return;
+		}
+		// DXYN: 在各自的显存上绘制, 取回碰撞标志
+		case 0xD000: {
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				machine_t& m = lanes[l];
+
+				word addr = I[l] & ADDR_MASK;
+				int h = ir & 0xF;
+				if (addr + h > MEM_SIZE)
+					h = MEM_SIZE - addr;
+
+				m.draw(vx[l], vy[l], m.ram + addr, h);
+				vf[l] = m.reg[0xF];
+
+				if (m.quirks & QUIRK_VBLANK_WAIT)
+				{
+					m.state = STATE_WAIT_VBLANK;
+					update_state(l);
+				}
+			}
+			return;
+		}
+		// EX9E, EXA1: 按各自的按键跳过
+		case 0xE000: {
+			bool pressed = (ir & 0xFF) == 0x9E;
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				if (((lanes[l].keys >> (vx[l] & 0xF)) & 1) == pressed)
+					PC[l] += 2;
+			}
+			return;
+		}
+		default:
+			break;
+	}
+
+	switch (ir & 0xFF)
+	{
+		// FX07: Vx=dt
+		case 0x07:
+			for (int l = base; l < base + 16; l++)
+				vx[l] = (byte)((dt[l] & on[l]) | (vx[l] & ~on[l]));
+			return;
+		// FX15: dt=Vx
+		case 0x15:
+			for (int l = base; l < base + 16; l++)
+				dt[l] = (byte)((vx[l] & on[l]) | (dt[l] & ~on[l]));
+			return;
+		// FX18: st=Vx
+		case 0x18:
+			for (int l = base; l < base + 16; l++)
+				st[l] = (byte)((vx[l] & on[l]) | (st[l] & ~on[l]));
+			return;
+		// FX1E: I+=Vx
+		case 0x1E:
+			for (int l = base; l < base + 16; l++)
+				I[l] += vx[l] & on[l];
+			return;
+		// FX29: 字符精灵的地址
+		case 0x29:
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				I[l] = (word)(lanes[l].font_mem_offset + (vx[l] & 0xF) * 4);
+			}
+			return;
+		// FX33: BCD
+		case 0x33:
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				byte* ram = lanes[l].ram;
+				byte v = vx[l];
+				ram[I[l] & ADDR_MASK] = (v / 100) % 10;
+				ram[(I[l] + 1) & ADDR_MASK] = (v / 10) % 10;
+				ram[(I[l] + 2) & ADDR_MASK] = v % 10;
+				mark_written(I[l], 3);
+			}
+			return;
+		// FX55: 储存V0-Vx, I+=x
+		case 0x55:
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				byte* ram = lanes[l].ram;
+				for (int i = 0; i <= x; i++)
+					ram[(I[l] + i) & ADDR_MASK] = V[i][l];
+				mark_written(I[l], x + 1);
+				I[l] += x;
+			}
+			return;
+		// FX65: 读取V0-Vx, I+=x
+		default:
+			for (uint32_t w = mask; w; w &= w - 1)
+			{
+				int l = lowest_bit(w);
+				const byte* ram = lanes[l].ram;
+				for (int i = 0; i <= x; i++)
+					V[i][l] = ram[(I[l] + i) & ADDR_MASK];
+				I[l] += x;
+			}
+			return;
+	}
+}
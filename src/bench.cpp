@@ -0,0 +1,438 @@
+// chip9-bench: 吞吐量基准测试
+// 用法: chip9-bench <data dir> [--cycles N] [--engine ref|predecode|jit] [--rom file]...
+// 在每种引擎上无窗口地运行卡带, 并单独测量draw, execute分派, reset, fork, 批量执行与调度的耗时, 结果以json输出到stdout
+#include "batch.h"
+#include "chip8.h"
+#include "common.h"
+#include "display.h"
+#include "engine.h"
+#include "fork.h"
+#include "scheduler.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace chip8;
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr uint64_t DEFAULT_CYCLES = 20000000;
+
+// 微基准的迭代次数
+constexpr int MICRO_ITERS = 2000000;
+constexpr int RESET_ITERS = 200000;
+
+// 并行探索的分支数与每个分支执行的帧数
+constexpr int FORK_BRANCHES = 256;
+constexpr int FORK_FRAMES = 60;
+
+// 调度器同时运行的机器数
+constexpr int SCHED_MACHINES = 1024;
+
+// 未指定--rom时测试的卡带
+static const char* DEFAULT_ROMS[] = {
+	"1-chip8-logo.ch8",
+	"2-ibm-logo.ch8",
+	"3-corax+.ch8",
+	"4-flags.ch8",
+	"5-quirks.ch8",
+	"6-keypad.ch8",
+	"7-beep.ch8",
+	"Pong.ch8",
+	"tetris.ch8",
+};
+
+// 每类指令选一条有代表性且可以反复执行的指令
+struct op_sample_t
+{
+	const char* name;
+	word ir;
+};
+
+static const op_sample_t OP_SAMPLES[] = {
+	{"00E0", 0x00E0},
+	{"1NNN", 0x1300},
+	{"2NNN", 0x2300},
+	{"3XNN", 0x3012},
+	{"4XNN", 0x4012},
+	{"5XY0", 0x5010},
+	{"6XNN", 0x6012},
+	{"7XNN", 0x7012},
+	{"8XY4", 0x8014},
+	{"9XY0", 0x9010},
+	{"ANNN", 0xA300},
+	{"BNNN", 0xB300},
+	{"CXNN", 0xC0FF},
+	{"DXYN", 0xD015},
+	{"EX9E", 0xE09E},
+	{"FX1E", 0xF01E},
+};
+
+// 微基准使用的占位程序
+static const byte IDLE_ROM[] = {0x12, 0x00};
+
+static double seconds_since(bench_clock::time_point t0)
+{
+	return std::chrono::duration<double>(bench_clock::now() - t0).count();
+}
+
+struct rom_result_t
+{
+	uint64_t cycles;
+	// 其中由skip_idle直接推进而没有逐条执行的周期数
+	uint64_t skipped;
+	// 经过的60hz虚拟帧数, 即需要重绘的次数上限
+	uint64_t frames;
+	// 卡带停机后重新装载的次数
+	uint64_t restarts;
+	// 执行所用的时间, 不含重新装载
+	double seconds;
+	// 重新装载与使引擎缓存失效所用的时间
+	double restart_seconds;
+};
+
+// 运行卡带直到累计执行cycles个周期, 停机后重新装载继续
+static rom_result_t bench_rom(const byte* rom, int len, engine_t e, uint64_t cycles)
+{
+	static machine_t m{};
+	m.reset(rom, len, nullptr, 0, 0);
+
+	runner_t r(m, e);
+	rom_result_t res{};
+
+	while (res.cycles < cycles)
+	{
+		uint64_t left = cycles - res.cycles;
+		uint64_t ticks = m.ticks;
+		uint64_t skipped = m.skipped_cycles;
+
+		auto t0 = bench_clock::now();
+		int n = r.run(left > 0x10000000 ? 0x10000000 : (int)left);
+		res.seconds += seconds_since(t0);
+
+		res.cycles += n;
+		res.skipped += m.skipped_cycles - skipped;
+		res.frames += m.ticks - ticks;
+
+		if (m.halted())
+		{
+			t0 = bench_clock::now();
+			res.restarts++;
+			m.reset(rom, len, nullptr, 0, 0);
+			r.invalidate();
+			res.restart_seconds += seconds_since(t0);
+		}
+	}
+	return res;
+}
+
+// 单条指令经execute分派的耗时
+static double bench_execute(word ir)
+{
+	static machine_t m{};
+	m.reset(IDLE_ROM, sizeof(IDLE_ROM), nullptr, 0, 0);
+	m.I = 0x300;
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < MICRO_ITERS; i++)
+	{
+		m.IR = ir;
+		m.PC = 0x202;
+		m.SP = 0;
+		m.state = STATE_RUNNING;
+		m.execute();
+	}
+	return seconds_since(t0) * 1e9 / MICRO_ITERS;
+}
+
+// 在不同位置绘制8x15的精灵
+static double bench_draw()
+{
+	static machine_t m{};
+	m.reset(IDLE_ROM, sizeof(IDLE_ROM), nullptr, 0, 0);
+
+	byte sprite[15];
+	for (int i = 0; i < 15; i++)
+		sprite[i] = (byte)(0x81 ^ (i * 0x11));
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < MICRO_ITERS; i++)
+		m.draw(i * 7, i * 3, sprite, 15);
+	return seconds_since(t0) * 1e9 / MICRO_ITERS;
+}
+
+// 每次改变一行后展开整个画面
+static double bench_present()
+{
+	static display_t d;
+	uint64_t vram[SCREEN_HEIGHT]{};
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < MICRO_ITERS; i++)
+	{
+		vram[i % SCREEN_HEIGHT] ^= 0x8100000000000081ull >> (i % 8);
+		d.update(vram, (uint64_t)i);
+	}
+	return seconds_since(t0) * 1e9 / MICRO_ITERS;
+}
+
+static double bench_reset(const byte* rom, int len)
+{
+	static machine_t m{};
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < RESET_ITERS; i++)
+		m.reset(rom, len, nullptr, 0, 0);
+	return seconds_since(t0) * 1e9 / RESET_ITERS;
+}
+
+static double bench_fork(const machine_t& parent)
+{
+	static machine_t child{};
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < RESET_ITERS; i++)
+		fork(parent, &child);
+	return seconds_since(t0) * 1e9 / RESET_ITERS;
+}
+
+// 从同一状态以不同的按键派生分支, 返回每秒执行的分支帧数
+static double bench_explore(fork_pool_t& pool, const machine_t& parent)
+{
+	std::vector<word> keys;
+	for (int i = 0; i < FORK_BRANCHES; i++)
+		keys.push_back((word)(1u << (i % 16)));
+
+	std::vector<machine_t> children;
+	std::vector<uint64_t> hashes;
+
+	auto t0 = bench_clock::now();
+	pool.explore(parent, keys, FORK_FRAMES, children, hashes);
+	return (double)FORK_BRANCHES * FORK_FRAMES / seconds_since(t0);
+}
+
+struct batch_result_t
+{
+	// 逐台以参考实现执行与批量执行时每秒逐条执行的机器周期数
+	double single_cycles_per_s;
+	double batch_cycles_per_s;
+	// 逐台执行时包含空转推进的周期数, 批量执行不跳过空转
+	double single_effective_cycles_per_s;
+	// 批量执行中共享解码的比例
+	double shared;
+};
+
+// 从同一状态以不同的按键派生BATCH_LANES台机器, 分别逐台与批量执行FORK_FRAMES帧
+static batch_result_t bench_batch(const machine_t& parent)
+{
+	static machine_t lanes[BATCH_LANES];
+	static batch_t batch;
+	int n = (int)(FORK_FRAMES * (uint64_t)parent.ips / 60);
+	batch_result_t res{};
+
+	for (int l = 0; l < BATCH_LANES; l++)
+	{
+		fork(parent, &lanes[l]);
+		lanes[l].keys = (word)(1u << (l % 16));
+	}
+	auto t0 = bench_clock::now();
+	uint64_t cycles = 0;
+	for (int l = 0; l < BATCH_LANES; l++)
+		cycles += lanes[l].run_for(n);
+	double single_seconds = seconds_since(t0);
+
+	uint64_t skipped = 0;
+	for (int l = 0; l < BATCH_LANES; l++)
+		skipped += lanes[l].skipped_cycles - parent.skipped_cycles;
+	res.single_cycles_per_s = (cycles - skipped) / single_seconds;
+	res.single_effective_cycles_per_s = cycles / single_seconds;
+
+	for (int l = 0; l < BATCH_LANES; l++)
+	{
+		fork(parent, &lanes[l]);
+		lanes[l].keys = (word)(1u << (l % 16));
+	}
+	t0 = bench_clock::now();
+	batch.load(lanes, BATCH_LANES);
+	batch.run(n);
+	batch.store();
+	double seconds = seconds_since(t0);
+
+	uint64_t total = batch.shared_steps + batch.single_steps;
+	res.batch_cycles_per_s = total / seconds;
+	res.shared = total ? (double)batch.shared_steps / total : 0;
+	return res;
+}
+
+// 在调度器上从同一状态以不同的按键运行SCHED_MACHINES台机器FORK_FRAMES帧
+static void bench_scheduler(const machine_t& parent)
+{
+	scheduler_t sched;
+	uint64_t cycles = FORK_FRAMES * (uint64_t)parent.ips / 60;
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < SCHED_MACHINES; i++)
+	{
+		int id = sched.add(parent, cycles);
+		sched.set_keys(id, (word)(1u << (i % 16)));
+	}
+	sched.wait_idle();
+	double seconds = seconds_since(t0);
+
+	uint64_t total = 0, skipped = 0, parks = 0, input = 0;
+	for (int i = 0; i < SCHED_MACHINES; i++)
+	{
+		machine_stats_t s = sched.machine_stats(i);
+		total += s.cycles - parent.cycles;
+		skipped += sched.machine(i).skipped_cycles - parent.skipped_cycles;
+		parks += s.parks;
+		input += s.park == PARK_INPUT;
+	}
+
+	// 与各ROM的结果相同, mips只计逐条执行的周期
+	uint64_t executed = total - skipped;
+	std::printf("\t\"scheduler\": {\"machines\": %d, \"frames\": %d, \"threads\": %d, \"seconds\": %.6f, "
+				"\"executed\": %" PRIu64 ", \"skipped\": %" PRIu64 ", \"mips\": %.3f, \"effective_mips\": %.3f, "
+				"\"parks\": %" PRIu64 ", \"waiting_input\": %" PRIu64 ", \"workers\": [",
+		SCHED_MACHINES, FORK_FRAMES, sched.threads(), seconds, executed, skipped, executed / seconds / 1e6,
+		total / seconds / 1e6, parks, input);
+
+	uint64_t uptime = sched.uptime_ns();
+	for (int i = 0; i < sched.threads(); i++)
+	{
+		worker_stats_t w = sched.worker_stats(i);
+		std::printf("%s{\"slices\": %" PRIu64 ", \"steals\": %" PRIu64 ", \"utilisation\": %.3f}", i ? ", " : "",
+			w.slices, w.steals, (double)w.busy_ns / uptime);
+	}
+	std::printf("]}\n}\n");
+}
+
+static void usage(const char* name)
+{
+	std::printf("usage: %s <data dir> [--cycles N] [--engine ref|predecode|jit] [--rom file]...\n", name);
+}
+
+int main(int argc, char** argv)
+{
+	const char* dir = nullptr;
+	uint64_t cycles = DEFAULT_CYCLES;
+	std::vector<engine_t> engines;
+	std::vector<std::string> roms;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (!std::strcmp(arg, "--cycles") && has_value)
+			cycles = std::strtoull(argv[++i], nullptr, 10);
+		else if (!std::strcmp(arg, "--engine") && has_value)
+		{
+			engine_t e;
+			if (!engine_from_str(argv[++i], &e))
+			{
+				std::printf("Error: unknown engine %s\n", argv[i]);
+				return 1;
+			}
+			engines.push_back(e);
+		}
+		else if (!std::strcmp(arg, "--rom") && has_value)
+			roms.push_back(argv[++i]);
+		else if (arg[0] != '-' && !dir)
+			dir = arg;
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!dir || !cycles)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (engines.empty())
+		for (int e = 0; e < ENGINE_COUNT; e++)
+			engines.push_back((engine_t)e);
+	if (roms.empty())
+		roms.assign(std::begin(DEFAULT_ROMS), std::end(DEFAULT_ROMS));
+
+	std::printf("{\n\t\"cycles\": %" PRIu64 ",\n\t\"roms\": [", cycles);
+
+	// 最后一个成功装载的卡带同时用于reset的测量
+	static byte rom[MEM_SIZE];
+	int rom_len = 0;
+
+	bool first = true;
+	for (const std::string& name : roms)
+	{
+		std::string path = std::string(dir) + "/" + name;
+		int len = MEM_SIZE - PROG_MEM_OFFSET;
+		if (!load_file(path.c_str(), rom, &len))
+			return 1;
+		rom_len = len;
+
+		for (engine_t e : engines)
+		{
+			// mips只计逐条执行的周期, 用于比较引擎; effective_mips包含空转推进的周期
+			rom_result_t res = bench_rom(rom, len, e, cycles);
+			uint64_t executed = res.cycles - res.skipped;
+			std::printf("%s\n\t\t{\"rom\": \"%s\", \"engine\": \"%s\", \"cycles\": %" PRIu64 ", \"executed\": %" PRIu64
+						", \"skipped\": %" PRIu64 ", \"seconds\": %.6f, \"mips\": %.3f, \"effective_mips\": %.3f, "
+						"\"frames\": %" PRIu64 ", \"frames_per_s\": %.1f, \"restarts\": %" PRIu64
+						", \"restart_seconds\": %.6f, \"ns_per_restart\": %.1f}",
+				first ? "" : ",", name.c_str(), engine_str(e), res.cycles, executed, res.skipped, res.seconds,
+				executed / res.seconds / 1e6, res.cycles / res.seconds / 1e6, res.frames, res.frames / res.seconds,
+				res.restarts, res.restart_seconds, res.restarts ? res.restart_seconds * 1e9 / res.restarts : 0.0);
+			std::fflush(stdout);
+			first = false;
+		}
+	}
+	std::printf("\n\t],\n\t\"execute\": [");
+
+	first = true;
+	for (const op_sample_t& s : OP_SAMPLES)
+	{
+		std::printf("%s\n\t\t{\"class\": \"%s\", \"opcode\": \"%04X\", \"ns_per_op\": %.3f}", first ? "" : ",", s.name,
+			s.ir, bench_execute(s.ir));
+		first = false;
+	}
+
+	double draw_ns = bench_draw();
+	std::printf("\n\t],\n\t\"draw\": {\"calls\": %d, \"ns_per_call\": %.3f, \"draws_per_s\": %.1f},\n", MICRO_ITERS,
+		draw_ns, 1e9 / draw_ns);
+
+	double present_ns = bench_present();
+	std::printf("\t\"present\": {\"calls\": %d, \"ns_per_call\": %.3f},\n", MICRO_ITERS, present_ns);
+
+	double reset_ns = bench_reset(rom, rom_len);
+	std::printf("\t\"reset\": {\"calls\": %d, \"ns_per_call\": %.3f},\n", RESET_ITERS, reset_ns);
+
+	// 从运行了一秒之后的状态派生
+	static machine_t parent{};
+	parent.reset(rom, rom_len, nullptr, 0, 0);
+	run_frames(parent, 0, 60);
+
+	fork_pool_t pool;
+	double fork_ns = bench_fork(parent);
+	double branch_frames = bench_explore(pool, parent);
+	std::printf("\t\"fork\": {\"calls\": %d, \"ns_per_call\": %.3f, \"threads\": %d, \"branches\": %d, \"frames\": %d, "
+				"\"branch_frames_per_s\": %.1f},\n",
+		RESET_ITERS, fork_ns, pool.threads(), FORK_BRANCHES, FORK_FRAMES, branch_frames);
+
+	batch_result_t batch = bench_batch(parent);
+	std::printf("\t\"batch\": {\"lanes\": %d, \"frames\": %d, \"single_mips\": %.3f, \"single_effective_mips\": %.3f, "
+				"\"batch_mips\": %.3f, \"shared\": %.3f},\n",
+		BATCH_LANES, FORK_FRAMES, batch.single_cycles_per_s / 1e6, batch.single_effective_cycles_per_s / 1e6,
+		batch.batch_cycles_per_s / 1e6, batch.shared);
+
+	bench_scheduler(parent);
+	return 0;
+}
@@ -1,19 +1,17 @@
 // 2025/7/23 13:57
 // https://tobiasvl.github.io/blog/write-a-chip-8-emulator/
-#include "common.h"
+#include "chip8.h"
+#include "profile.h"
+#include "trace.h"
 
-#include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
-#define assertm(expr, msg) \
-	if (!(expr)) \
-	{ \
-		std::printf("Assertion failed: %s\nFile: %s, Line: %d\n", msg, __FILE__, __LINE__); \
-		exit(EXIT_FAILURE); \
-	}
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
 
 // 默认的字体数据和偏移
 constexpr int DEFAULT_FONT_MEM_OFFSET = 0x050;
@@ -44,184 +42,92 @@ constexpr int FIXED_SPRITE_WIDTH = 8;
 constexpr int FIXED_FONT_WIDTH = 4;
 constexpr int FIXED_FONT_HEIGHT = 5;
 
-// 4069字节的内存
-constexpr int PROG_MEM_OFFSET = 0x200;
-static byte ram[0xFFF]{};
-
-// 64*32的显存, 每位代表一个像素
-// 64*32/8=256字节
-constexpr int SCREEN_WIDTH = 64;
-constexpr int SCREEN_HEIGHT = 32;
-static byte vram[SCREEN_WIDTH * SCREEN_HEIGHT / 8]{};
-
-// 16个通用寄存器
-static byte reg[16]{};
-
-// 地址寄存器
-static word I = 0;
-
-// 指令与程序计数器
-static word IR = 0;
-static word PC = 0;
-
-// 堆栈
-constexpr int STACK_DEEP = 16;
-static word stack[16]{};
+using namespace chip8;
 
-// 栈顶指针
-static byte SP = 0;
-
-// 计时器
-static byte dt = 0;
-static byte st = 0;
-
-// 可配置项
-// 字体精灵的储存位置
-word cfg_font_mem_offset = 0;
-
-// 从字节数组中读取特定位
-bool read_bit(const byte* dat, int len, int bit_index)
-{
-	int index = bit_index / 8;
-	bit_index = bit_index % 8;
-	assertm(dat && index < len, "index out of range");
-
-	return (dat[index] >> (7 - bit_index)) & 1;
-}
+// 内存地址掩码, 越界的地址将回绕
+constexpr word ADDR_MASK = MEM_SIZE - 1;
 
-// 对目标位进行xor
-// 冲突时返回true
-bool xor_bit(byte* dat, int len, int bit_index, bool rhs)
+// 每个像素的Zobrist键, 按行与行内的位序号(0为最低位, 即x=63)索引
+// 由固定种子的splitmix64生成, 同一画面在任何进程中的散列都相同
+static const struct zobrist_t
 {
-	int index = bit_index / 8;
-	bit_index = bit_index % 8;
-	assertm(dat && index < len, "index out of range");
+	uint64_t keys[SCREEN_HEIGHT][SCREEN_WIDTH];
 
-	// 计算目标位的掩码
-	byte mask = rhs ? (1 << (7 - bit_index)) : 0;
-	bool old = (dat[index] & mask) != 0;
-
-	dat[index] ^= mask;
-
-	return old && rhs;
-}
-
-// 将字节数组中的每一位整体左移
-// 最终结果被写入到dst, src与dst可以指向同一个数组
-// 返回最后一个字节中溢出的部分
-byte array_left_shift(const byte* src, byte* dst, unsigned int len, unsigned int n)
-{
-	// 用于获取溢出部分的掩码
-	byte mask = 0xF >> n;
-
-	// 用于缓存溢出的部分
-	byte bits1 = 0, bits2 = 0;
-
-	unsigned int i;
-	for (i = 0; i < len; i++)
+	zobrist_t()
 	{
-		// 缓存溢出的尾部并写入下一字节的头部
-		bits2 = src[i] & mask;
-		dst[i] = src[i] >> n;
-		dst[i] = src[i] | (bits1 << (8 - n));
-		bits1 = bits2;
+		uint64_t s = 0x5A0B815700C0FFEEull;
+		for (int y = 0; y < SCREEN_HEIGHT; y++)
+		{
+			for (int b = 0; b < SCREEN_WIDTH; b++)
+			{
+				uint64_t z = (s += 0x9E3779B97F4A7C15ull);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				keys[y][b] = z ^ (z >> 31);
+			}
+		}
 	}
-	return bits1;
+} ZOBRIST;
+
+static inline int lowest_bit(uint64_t v)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward64(&i, v);
+	return (int)i;
+#else
+	return __builtin_ctzll(v);
+#endif
 }
 
-// 在屏幕上绘制精灵
-// 将对x,y进行取模, 绘制冲突时设置VF为1
-void draw(int x, int y, const byte* sp, int h)
+void machine_t::draw(int x, int y, const byte* sp, int h)
 {
 	// 对坐标进行取模
 	x %= SCREEN_WIDTH;
 	y %= SCREEN_HEIGHT;
 
-	reg[0xF] = 0;
+	// 裁剪超出底部的行
+	if (h > SCREEN_HEIGHT - y)
+		h = SCREEN_HEIGHT - y;
 
+	uint64_t collision = 0;
+	uint64_t hash = frame_hash;
 	for (int row = 0; row < h; row++)
 	{
-		int cy = y + row;
-		if (cy >= SCREEN_HEIGHT)
-			break;
-
-		for (int col = 0; col < 8; col++)
-		{
-			int cx = x + col;
-			if (cx >= SCREEN_WIDTH)
-				break;
+		// 将精灵行移动到x处, 超出右边缘的位被直接移出
+		uint64_t bits = (uint64_t)sp[row] << (64 - FIXED_SPRITE_WIDTH) >> x;
 
-			bool old = read_bit(vram, sizeof(vram), cy * SCREEN_WIDTH + cx);
+		uint64_t& line = vram[y + row];
+		collision |= line & bits;
+		line ^= bits;
 
-			// 在当前行里读取
-			bool src = read_bit(sp + row, 1, col);
-			reg[0xF] |= xor_bit(vram, sizeof(vram), cy * SCREEN_WIDTH + cx, src);
+		if (bits)
+		{
+			dirty_rows |= 1u << (y + row);
 
-			bool vnew = read_bit(vram, sizeof(vram), cy * SCREEN_WIDTH + cx);
+			// 翻转的像素恰好是bits中的位
+			const uint64_t* keys = ZOBRIST.keys[y + row];
+			for (uint64_t b = bits; b; b &= b - 1)
+				hash ^= keys[lowest_bit(b)];
 		}
 	}
-}
+	frame_hash = hash;
 
-// 调试打印
-void print_bytes(const byte* dat, int len)
-{
-	for (int i = 0; i < sizeof(vram); i++)
-		std::printf("%02X ", vram[i]);
-	std::printf("\n");
+	reg[0xF] = collision != 0;
 }
-void print_vram()
-{
-	clear_screen();
-	for (int y = 0; y < SCREEN_HEIGHT; ++y)
-	{
-		// std::printf("%02X ", y);
-		// for (int x = 0; x < SCREEN_WIDTH; ++x)
-		// {
-		// 	int pos = y * SCREEN_WIDTH + x;
-		// 	bool p = read_bit(vram, sizeof(vram), pos);
-		// 	std::cout << (p ? '#' : '.');
-		// }
-		// std::cout << '\n';
-		for (int x = 0; x < SCREEN_WIDTH; ++x)
-		{
-			int pos = y * SCREEN_WIDTH + x;
-			bool f = read_bit(vram, sizeof(vram), pos);
-			screen_pixel(x, y, f);
-		}
-	}
-}
-
-// execute的执行状态
-enum state_t
-{
-	// 正常运行中
-	STATE_RUNNING,
-	// 屏幕像素更新
-	STATE_VRAM_UPDATE,
-	// 等待按键输入
-	// 经典vip模式时, 将等待一个完整的按键按下-松开过程
-	STATE_WAIT_KEY,
-	STATE_WAIT_KEY_UP,
-	// 死循环
-	STATE_INFINITE_LOOP,
-	// 当前执行的指令未实现或是无效的
-	STATE_NOT_IMPL,
-	// 栈溢出
-	STATE_ERROR_STAKE_FULL,
-	// 尝试令空栈弹出
-	STATE_ERROR_POP_EMPTY_STAKC,
-};
 
-const char* state_tostr(state_t st)
+const char* chip8::state_str(state_t st)
 {
 	switch (st)
 	{
 		case STATE_RUNNING:
 			return "STATE_RUNNING";
-		case STATE_VRAM_UPDATE:
-			return "STATE_VRAM_UPDATE";
+		case STATE_WAIT_VBLANK:
+			return "STATE_WAIT_VBLANK";
 		case STATE_WAIT_KEY:
 			return "STATE_WAIT_KEY";
+		case STATE_WAIT_KEY_UP:
+			return "STATE_WAIT_KEY_UP";
 		case STATE_INFINITE_LOOP:
 			return "STATE_INFINITE_LOOP";
 		case STATE_NOT_IMPL:
@@ -236,37 +142,41 @@ const char* state_tostr(state_t st)
 }
 
 // 从内存中查找下一条指令
-void fetch(state_t* state)
+void machine_t::fetch()
 {
-	if (*state != STATE_RUNNING)
+	if (state != STATE_RUNNING)
 		return;
 
-	byte h = ram[PC++];
-	byte l = ram[PC++];
+	byte h = ram[PC++ & ADDR_MASK];
+	byte l = ram[PC++ & ADDR_MASK];
 	IR = (word)((h << 8) | l);
 }
 
 // 执行当前指令
 // state指示运行状态, 在执行完毕过程中state可能被更新
-// ctx缓存上一个状态时记录的寄存器编号, 可能是无效的
+// cached_reg缓存上一个状态时记录的寄存器编号, 可能是无效的
 // 在执行完毕后处理异常state, 停止运行或是重置state后再调用execute继续执行
-void execute(state_t* state, byte* cached_reg)
+void machine_t::execute()
 {
 	// 处理0xFX0A的按键阻塞
 	// Vx已被记录到cached_reg
-	if (*state == STATE_WAIT_KEY)
+	if (state == STATE_WAIT_KEY)
 	{
-		byte key_id;
-		if (any_key(key_state_t::RELEASE, &key_id))
+		if (keys_released)
 		{
-			reg[*cached_reg] = key_id;
-			*state = STATE_RUNNING;
+			byte key_id = 0;
+			while (!(keys_released & (1 << key_id)))
+				key_id++;
+
+			reg[cached_reg] = key_id;
+			keys_released = 0;
+			state = STATE_RUNNING;
 		}
 		// std::printf("wait key: %X\n", key_id);
 		return;
 	}
-	// 忽略其他无效状态
-	else if (*state != STATE_RUNNING)
+	// 垂直消隐的等待由advance结束, 忽略其他无效状态
+	else if (state != STATE_RUNNING)
 		return;
 
 	constexpr word HEAD_MASK = 0xF000;
@@ -276,8 +186,7 @@ void execute(state_t* state, byte* cached_reg)
 			// 00E0: 清屏
 			if (IR == 0x00E0)
 			{
-				std::memset(vram, 0, sizeof(vram));
-				*state = STATE_VRAM_UPDATE;
+				clear_vram();
 			}
 			// 00EE: 弹出栈顶地址
 			else if (IR == 0x00EE)
@@ -285,7 +194,7 @@ void execute(state_t* state, byte* cached_reg)
 				// 检查空栈
 				if (SP == 0)
 				{
-					*state = STATE_ERROR_POP_EMPTY_STAKC;
+					state = STATE_ERROR_POP_EMPTY_STAKC;
 					return;
 				}
 
@@ -294,7 +203,7 @@ void execute(state_t* state, byte* cached_reg)
 			}
 			else
 			{
-				*state = STATE_NOT_IMPL;
+				state = STATE_NOT_IMPL;
 			}
 			return;
 		}
@@ -305,7 +214,7 @@ void execute(state_t* state, byte* cached_reg)
 			// 额外处理死循环
 			if (addr == PC - 2)
 			{
-				*state = STATE_INFINITE_LOOP;
+				state = STATE_INFINITE_LOOP;
 				return;
 			}
 
@@ -317,7 +226,7 @@ void execute(state_t* state, byte* cached_reg)
 			// 检查栈溢出
 			if (SP >= STACK_DEEP)
 			{
-				*state = STATE_ERROR_STAKE_FULL;
+				state = STATE_ERROR_STAKE_FULL;
 				return;
 			}
 
@@ -432,7 +341,7 @@ void execute(state_t* state, byte* cached_reg)
 					return;
 				}
 				default: {
-					*state = STATE_NOT_IMPL;
+					state = STATE_NOT_IMPL;
 					return;
 				}
 			}
@@ -460,26 +369,30 @@ void execute(state_t* state, byte* cached_reg)
 		// CXNN: Vx=rand() & NN
 		case 0xC000: {
 			byte r = (byte)((IR & 0x0F00) >> 8);
-			byte val = (byte)(IR & 0x00FF) & (std::rand() % 256);
+			byte val = (byte)(IR & 0x00FF) & random();
 			reg[r] = val;
 			return;
 		}
 		// DXYN: 绘制精灵
 		case 0xD000: {
-			// 精灵数据
-			byte* sp_dat = ram + I;
+			// 精灵数据, 不允许读出内存末尾
+			word addr = I & ADDR_MASK;
+			byte* sp_dat = ram + addr;
 
 			// 绘制坐标
 			byte x_reg = (IR & 0x0F00) >> 8;
 			byte y_reg = (IR & 0x00F0) >> 4;
 
 			// 精灵高度
-			byte sp_h = IR & 0x000F;
+			int sp_h = IR & 0x000F;
+			if (addr + sp_h > MEM_SIZE)
+				sp_h = MEM_SIZE - addr;
 
 			// 绘制并自动处理VF碰撞标志
 			draw(reg[x_reg], reg[y_reg], sp_dat, sp_h);
 
-			*state = STATE_VRAM_UPDATE;
+			if (quirks & QUIRK_VBLANK_WAIT)
+				state = STATE_WAIT_VBLANK;
 
 			return;
 		}
@@ -490,18 +403,18 @@ void execute(state_t* state, byte* cached_reg)
 			// EX9E: if (keys(Vx)) PC+=2
 			if (opcode == 0xE09E)
 			{
-				if (get_key(reg[r] & 0xF) == key_state_t::PRESSED)
+				if (keys & (1 << (reg[r] & 0xF)))
 					PC += 2;
 			}
 			// EXA1: if (!keys(Vx)) PC+=2
 			else if (opcode == 0xE0A1)
 			{
-				if (get_key(reg[r] & 0xF) != key_state_t::PRESSED)
+				if (!(keys & (1 << (reg[r] & 0xF))))
 					PC += 2;
 			}
 			else
 			{
-				*state = STATE_NOT_IMPL;
+				state = STATE_NOT_IMPL;
 			}
 			return;
 		}
@@ -518,8 +431,10 @@ void execute(state_t* state, byte* cached_reg)
 			// FX0A: 阻塞的等待按键按下并储存到Vx
 			else if (opcode == 0xF00A)
 			{
-				*state = STATE_WAIT_KEY;
-				*cached_reg = r;
+				// 只响应进入等待之后松开的键
+				state = STATE_WAIT_KEY;
+				cached_reg = r;
+				keys_released = 0;
 			}
 			// FX15: delay_timer=Vx
 			else if (opcode == 0xF015)
@@ -540,22 +455,22 @@ void execute(state_t* state, byte* cached_reg)
 			else if (opcode == 0xF029)
 			{
 				// 每个字符精灵占用2字节
-				I = cfg_font_mem_offset + (reg[r] & 0xF) * 4;
+				I = font_mem_offset + (reg[r] & 0xF) * 4;
 			}
 			// FX33: 拆解Vx的百,十,个位, 分别储存到I,I+1,I+2
 			else if (opcode == 0xF033)
 			{
 				byte val = reg[r];
 
-				ram[I] = (val / 100) % 10;
-				ram[I + 1] = (val / 10) % 10;
-				ram[I + 2] = val % 10;
+				ram[I & ADDR_MASK] = (val / 100) % 10;
+				ram[(I + 1) & ADDR_MASK] = (val / 10) % 10;
+				ram[(I + 2) & ADDR_MASK] = val % 10;
 			}
 			// FX55: 将V0-Vx储存到I-I+x
 			else if (opcode == 0xF055)
 			{
 				for (int i = 0; i <= r; i++)
-					ram[I + i] = reg[i];
+					ram[(I + i) & ADDR_MASK] = reg[i];
 
 				// 没有记录的原始实现定义行为
 				I += r;
@@ -564,171 +479,452 @@ void execute(state_t* state, byte* cached_reg)
 			else if (opcode == 0xF065)
 			{
 				for (int i = 0; i <= r; i++)
-					reg[i] = ram[I + i];
+					reg[i] = ram[(I + i) & ADDR_MASK];
 
 				// 没有记录的原始实现定义行为
 				I += r;
 			}
 			else
 			{
-				*state = STATE_NOT_IMPL;
+				state = STATE_NOT_IMPL;
 			}
 			return;
 		}
 	}
 }
 
-void reset(const byte* rom, int rom_len, const byte* font, int _font_mem_offset, int font_len)
+bool machine_t::reset(const byte* rom, int rom_len, const byte* font, int _font_mem_offset, int font_len)
 {
-	assertm(rom && rom_len > 0 && rom_len <= sizeof(ram) - PROG_MEM_OFFSET, "rom data invaild");
+	if (!rom || rom_len <= 0 || rom_len > MEM_SIZE - PROG_MEM_OFFSET)
+		return false;
+
+	// 写入字体
+	if (!font)
+	{
+		font = DEFAULT_FONT_DAT;
+		font_len = sizeof(DEFAULT_FONT_DAT);
+		_font_mem_offset = DEFAULT_FONT_MEM_OFFSET;
+	}
+
+	if (_font_mem_offset < 0 || _font_mem_offset + font_len > MEM_SIZE || font_len <= 0)
+		return false;
 
 	IR = 0;
 	I = 0;
 	PC = PROG_MEM_OFFSET;
+	SP = 0;
 
 	st = 0;
 	dt = 0;
 
+	state = STATE_RUNNING;
+	cached_reg = 0;
+
+	keys = 0;
+	keys_released = 0;
+
+	cycles = 0;
+	ticks = 0;
+	next_tick = 0;
+	sound_ticks = 0;
+	skipped_cycles = 0;
+	tick_frac = 0;
+	set_clock(DEFAULT_IPS);
+	schedule_tick();
+
+	rng = DEFAULT_RNG_SEED;
+	quirks = 0;
+	idle_miss_tick = ~0ull;
+
 	std::memset(reg, 0, sizeof(reg));
+	std::memset(stack, 0, sizeof(stack));
 	std::memset(vram, 0, sizeof(vram));
 	std::memset(ram, 0, sizeof(ram));
+	frame_hash = 0;
+
+	// 装载后整屏重绘
+	dirty_rows = ~0u;
 	std::memcpy(ram + PROG_MEM_OFFSET, rom, rom_len);
 
-	// 写入字体
-	if (!font)
-	{
-		font = DEFAULT_FONT_DAT;
-		font_len = sizeof(DEFAULT_FONT_DAT);
-		_font_mem_offset = DEFAULT_FONT_MEM_OFFSET;
-	}
+	font_mem_offset = _font_mem_offset;
+	std::memcpy(ram + font_mem_offset, font, font_len);
+	return true;
+}
 
-	assertm(_font_mem_offset >= 0 && _font_mem_offset < sizeof(ram) && font_len > 0, "font data invaild");
+void machine_t::snapshot(snapshot_t* s) const { std::memcpy(&s->m, this, sizeof(machine_t)); }
 
-	cfg_font_mem_offset = _font_mem_offset;
-	std::memcpy(ram + cfg_font_mem_offset, font, font_len);
+void machine_t::restore(const snapshot_t& s)
+{
+	profile_t* _profile = profile;
+	trace_writer_t* _trace = trace;
+
+	std::memcpy(this, &s.m, sizeof(machine_t));
+
+	profile = _profile;
+	trace = _trace;
+	dirty_rows = ~0u;
 }
 
-// 更新计时器
-void update_timer()
+// 读取addr处的指令
+static word op_at(const machine_t& m, int addr)
 {
-	static uint64_t st_timer = 0;
-	static uint64_t dt_timer = 0;
+	return (word)((m.ram[addr & ADDR_MASK] << 8) | m.ram[(addr + 1) & ADDR_MASK]);
+}
 
-	constexpr int Interval = 1000 / 60;
+// 空转循环最多包含的指令数
+constexpr int MAX_IDLE_LOOP = 16;
 
-	if (st)
+// 延时轮询可推进的周期少于这个数时不值得逐帧模拟
+constexpr uint64_t MIN_IDLE_SKIP = 32;
+
+// 从当前状态试执行一轮循环
+// 循环只能由比较, 跳转, FX07等不写内存与显存的指令组成, 回到PC时寄存器与执行前相同则每一轮都完全一样
+// 返回一轮的指令数, 不是空转循环时返回0, 回到了PC但寄存器发生了变化时返回-1
+// *reads_dt为循环是否读取delay_timer, *last_ir为一轮中最后执行的指令
+static int idle_loop(const machine_t& m, bool* reads_dt, word* last_ir)
+{
+	byte reg[16];
+	std::memcpy(reg, m.reg, sizeof(reg));
+
+	word pc = m.PC;
+	*reads_dt = false;
+	for (int len = 1; len <= MAX_IDLE_LOOP; len++)
 	{
-		if (!st_timer)
-			st_timer = uptime_ms();
-		else if (uptime_ms() - st_timer >= Interval)
+		word ir = op_at(m, pc);
+		pc += 2;
+
+		byte x = (ir & 0x0F00) >> 8;
+		byte y = (ir & 0x00F0) >> 4;
+		byte nn = ir & 0x00FF;
+		switch (ir >> 12)
 		{
-			st -= 1;
-			st_timer += Interval;
+			case 0x1: {
+				// 跳转到自身由execute处理为死循环
+				word addr = (word)(ir & 0x0FFF);
+				if (addr == pc - 2)
+					return 0;
+				pc = addr;
+				break;
+			}
+			case 0x3: {
+				if (reg[x] == nn)
+					pc += 2;
+				break;
+			}
+			case 0x4: {
+				if (reg[x] != nn)
+					pc += 2;
+				break;
+			}
+			case 0x5: {
+				if (reg[x] == reg[y])
+					pc += 2;
+				break;
+			}
+			case 0x6: {
+				reg[x] = nn;
+				break;
+			}
+			case 0x8: {
+				if (ir & 0x000F)
+					return 0;
+				reg[x] = reg[y];
+				break;
+			}
+			case 0x9: {
+				if (reg[x] != reg[y])
+					pc += 2;
+				break;
+			}
+			case 0xE: {
+				bool pressed = (m.keys & (1 << (reg[x] & 0xF))) != 0;
+				if ((ir & 0xF0FF) == 0xE09E)
+					pc += pressed ? 2 : 0;
+				else if ((ir & 0xF0FF) == 0xE0A1)
+					pc += pressed ? 0 : 2;
+				else
+					return 0;
+				break;
+			}
+			case 0xF: {
+				if ((ir & 0xF0FF) != 0xF007)
+					return 0;
+				reg[x] = m.dt;
+				*reads_dt = true;
+				break;
+			}
+			default:
+				return 0;
 		}
-	}
-	else
-		st_timer = 0;
 
-	if (dt)
-	{
-		if (!dt_timer)
-			dt_timer = uptime_ms();
-		else if (uptime_ms() - dt_timer >= Interval)
+		if (pc == m.PC)
 		{
-			dt -= 1;
-			dt_timer += Interval;
+			if (std::memcmp(reg, m.reg, sizeof(reg)))
+				return -1;
+			*last_ir = ir;
+			return len;
 		}
 	}
-	else
-		dt_timer = 0;
+	return 0;
 }
 
-// 运行期间的上下文变量
-state_t state = STATE_RUNNING;
-byte cached_reg = 0;
-
-bool quit = false;
-uint32_t time = 0;
-
-const char* state_str()
+idle_t machine_t::idle() const
 {
-	static char _buf[100]{};
-
-	std::snprintf(_buf, sizeof(_buf), "st:%3d,dt:%3d,state:%s", st, dt, state_tostr(state));
-	_buf[sizeof(_buf) - 1] = 0;
+	if (state == STATE_WAIT_KEY)
+		return keys_released ? IDLE_NONE : IDLE_INPUT;
+	if (state == STATE_WAIT_VBLANK)
+		return IDLE_TIMER;
+	if (state != STATE_RUNNING)
+		return IDLE_NONE;
+
+	bool reads_dt;
+	word last_ir;
+	if (idle_loop(*this, &reads_dt, &last_ir) <= 0)
+		return IDLE_NONE;
+	return reads_dt ? IDLE_TIMER : IDLE_INPUT;
+}
 
-	return _buf;
+// ir是否为idle_loop允许的指令, 在pc处执行
+static bool poll_op(word ir, word pc)
+{
+	switch (ir >> 12)
+	{
+		case 0x1:
+			return (word)(ir & 0x0FFF) != pc;
+		case 0x3:
+		case 0x4:
+		case 0x5:
+		case 0x6:
+		case 0x9:
+			return true;
+		case 0x8:
+			return !(ir & 0x000F);
+		case 0xE:
+			return (ir & 0xF0FF) == 0xE09E || (ir & 0xF0FF) == 0xE0A1;
+		case 0xF:
+			return (ir & 0xF0FF) == 0xF007;
+		default:
+			return false;
+	}
 }
 
-void start(const char* file_path)
+int machine_t::fast_forward(int n)
 {
-	// char file_path[100]{};
-	// std::scanf("inp test rom: %99s\n", file_path);
+	if (profile || trace || n <= 0)
+		return 0;
 
-	byte buffer[0xFFF]{};
-	int len = sizeof(buffer);
+	if (state == STATE_WAIT_KEY)
+	{
+		if (keys_released)
+			return 0;
+		advance(n);
+		skipped_cycles += n;
+		return n;
+	}
+	// 垂直消隐之前没有可执行的指令
+	if (state == STATE_WAIT_VBLANK)
+	{
+		int k = next_tick - cycles < (uint64_t)n ? (int)(next_tick - cycles) : n;
+		advance(k);
+		skipped_cycles += k;
+		return k;
+	}
+	if (state != STATE_RUNNING)
+		return 0;
+
+	bool reads_dt;
+	word last_ir;
+	int len = idle_loop(*this, &reads_dt, &last_ir);
+	// 不是轮询循环, 或不读取delay_timer却改变了寄存器时本帧内不再检测
+	if (!len || (len < 0 && !reads_dt))
+	{
+		idle_miss_tick = ticks;
+		return 0;
+	}
+
+	// 只轮询按键时每一轮都一样, 推进整数轮循环
+	if (!reads_dt)
+	{
+		int k = n / len * len;
+		if (k)
+		{
+			IR = last_ir;
+			advance(k);
+			skipped_cycles += k;
+		}
+		return k;
+	}
 
-	if (!load_file(file_path, buffer, &len))
+	if (n < (int)MIN_IDLE_SKIP)
 	{
-		std::printf("rom %s load faild\n", file_path);
-		exit(-1);
+		idle_miss_tick = ticks;
+		return 0;
 	}
 
-	// 初始化cpu并清空ram/寄存器组
-	reset(buffer, len, nullptr, 0, 0);
+	// 逐帧推进: 计时器递减之前推进整数轮, 跨过递减的一轮逐条执行, 直到循环的比较使其退出
+	word head = PC;
+	int done = 0;
+	while (done < n)
+	{
+		if (len > 0)
+		{
+			uint64_t left = (uint64_t)(n - done);
+			if (next_tick - cycles < left)
+				left = next_tick - cycles;
+			int k = (int)(left / len * len);
+			if (k)
+			{
+				uint64_t t = ticks;
+				IR = last_ir;
+				advance(k);
+				skipped_cycles += k;
+				done += k;
+				// 没有跨过递减时状态与推进前相同
+				if (ticks != t)
+					len = idle_loop(*this, &reads_dt, &last_ir);
+				continue;
+			}
+		}
 
-	std::printf("rom %s load done. len: %d\n", file_path, len);
+		// 逐条执行一轮, 离开允许的指令时停止
+		int i = 0;
+		do
+		{
+			word ir = op_at(*this, PC);
+			if (!poll_op(ir, PC))
+				break;
+			fetch();
+			execute();
+			advance(1);
+			done++;
+			i++;
+		} while (PC != head && i < MAX_IDLE_LOOP && done < n);
+
+		if (!i || PC != head || state != STATE_RUNNING)
+			break;
+		len = idle_loop(*this, &reads_dt, &last_ir);
+		if (!len)
+			break;
+	}
+
+	if (done < n)
+		idle_miss_tick = ticks;
+	return done;
 }
 
-void update()
+int machine_t::run_for(int n)
 {
-	if (quit)
-		return;
+	int count = 0;
+	while (count < n)
+	{
+		// 空转时直接推进
+		if (int skipped = skip_idle(n - count))
+		{
+			count += skipped;
+			continue;
+		}
+
+		if (state == STATE_RUNNING)
+		{
+			fetch();
+			if (profile)
+				profile->count(*this, PC - 2, IR);
+		}
+		else if (!waiting())
+			break;
+		else if (profile && state == STATE_WAIT_KEY)
+			profile->count_wait();
+
+		execute();
+		count++;
+		advance(1);
 
-	word old_pc = PC;
+		if (trace)
+			trace->record(*this);
 
-	fetch(&state);
-	execute(&state, &cached_reg);
+		if (halted())
+			break;
+	}
+	return count;
+}
 
-	update_timer();
+// 更新计时器
+void machine_t::update_timer()
+{
+	if (st)
+	{
+		st -= 1;
+		sound_ticks++;
+	}
+	if (dt)
+		dt -= 1;
+}
 
-	// 打印指令运行信息
-	if (debug_out())
+void machine_t::clear_vram()
+{
+	// 只有原本有内容的行发生了变化
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
 	{
-		std::printf("PC=0x%04X,IR=0x%04X,NPC=0x%04X,I=0x%04X reg={", old_pc, IR, PC, I);
-		for (int i = 0; i < 16; i++)
-		{
-			// if (reg[i])
-			std::printf("%X:0x%02X,", i, reg[i]);
-		}
-		std::printf("} state=%s,st=%d,dt=%d\n", state_tostr(state), st, dt);
+		if (vram[y])
+			dirty_rows |= 1u << y;
+		vram[y] = 0;
 	}
+	frame_hash = 0;
+}
 
-	// 处理运行状态
-	// 稍后重置状态或是退出
-	if (state != STATE_RUNNING || state != STATE_WAIT_KEY)
+uint64_t machine_t::hash_vram() const
+{
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
 	{
-		switch (state)
+		for (int i = 7; i >= 0; i--)
 		{
-			case STATE_VRAM_UPDATE: {
-				print_vram();
-				state = STATE_RUNNING;
-				break;
-			}
-			case STATE_INFINITE_LOOP: {
-				std::printf("INFINITE LOOP\n");
-				quit = true;
-				break;
-			}
-			case STATE_NOT_IMPL:
-			case STATE_ERROR_STAKE_FULL:
-			case STATE_ERROR_POP_EMPTY_STAKC: {
-				std::printf("ERROR: %s, PC=%04X,IR=%04X\n", state_tostr(state), old_pc, IR);
-				quit = true;
-				break;
-			}
-			default:
-				break;
+			h ^= (byte)(vram[y] >> (i * 8));
+			h *= 0x100000001B3ull;
 		}
 	}
-}
\ No newline at end of file
+	return h;
+}
+
+bool machine_t::read_vram(int x, int y) const
+{
+	x %= SCREEN_WIDTH;
+	y %= SCREEN_HEIGHT;
+	return (vram[y] >> (SCREEN_WIDTH - 1 - x)) & 1;
+}
+
+void machine_t::read_timer(byte* delay_timer, byte* sound_timer) const
+{
+	if (delay_timer)
+		*delay_timer = dt;
+	if (sound_timer)
+		*sound_timer = st;
+}
+
+void machine_t::set_key_state(int key_id, bool pressed)
+{
+	if (key_id < 0 || key_id >= 16)
+		return;
+
+	word mask = (word)(1 << key_id);
+	if (pressed)
+		keys |= mask;
+	else
+	{
+		if (keys & mask)
+			keys_released |= mask;
+		keys &= ~mask;
+	}
+}
+
+const char* machine_t::debug_info() const
+{
+	static thread_local char _buf[256]{};
+
+	int n = std::snprintf(_buf, sizeof(_buf), "PC=0x%04X,IR=0x%04X,I=0x%04X,SP=%d reg={", PC, IR, I, SP);
+	for (int i = 0; i < 16; i++)
+		n += std::snprintf(_buf + n, sizeof(_buf) - n, "%X:0x%02X,", i, reg[i]);
+	std::snprintf(_buf + n, sizeof(_buf) - n, "} state=%s,st=%d,dt=%d", state_str(state), st, dt);
+
+	return _buf;
+}
@@ -1,18 +1,11 @@
 #include "common.h"
 
-#include <SDL3/SDL.h>
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <windows.h>
-
-void buzzer(int frequency, int duration) { Beep(frequency, duration); }
-
-uint64_t uptime_ns() { return SDL_GetTicksNS(); }
-uint64_t uptime_ms() { return SDL_GetTicks(); }
-
-void delay_ms(uint32_t ms) { SDL_Delay(ms); }
-void delay_ns(uint32_t ns) { SDL_Delay(ns); }
 
 bool load_file(const char* filename, byte* buffer, int* len)
 {
@@ -43,4 +36,4 @@ bool load_file(const char* filename, byte* buffer, int* len)
 
 	*len = file.gcount();
 	return true;
-}
\ No newline at end of file
+}
@@ -0,0 +1,130 @@
+#include "display.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define DISPLAY_SSE2 1
+#endif
+
+using namespace chip8;
+
+// 点亮的像素与棋盘格背景的灰度
+constexpr byte FG = 20;
+constexpr byte BG0 = 135;
+constexpr byte BG1 = 150;
+
+constexpr uint32_t ALPHA = 0xFF000000u;
+
+display_t::display_t() : intensity{}, background{}, rgba{}, last_hash(0), fading(false), valid(false)
+{
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+	{
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+			background[y * SCREEN_WIDTH + x] = (x + y) & 1 ? BG0 : BG1;
+	}
+}
+
+#ifdef DISPLAY_SSE2
+
+bool display_t::update(const uint64_t* vram, uint64_t hash)
+{
+	if (valid && !fading && hash == last_hash)
+		return false;
+
+	// 每字节选出对应像素的位, 前8个字节对应高字节
+	const __m128i select = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	const __m128i decay = _mm_set1_epi8((char)DISPLAY_DECAY);
+	const __m128i fg = _mm_set1_epi16(FG);
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i full = _mm_set1_epi8((char)0xFF);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32((int)ALPHA);
+
+	__m128i partial = zero;
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+	{
+		uint64_t row = vram[y];
+		for (int c = 0; c < SCREEN_WIDTH / 16; c++)
+		{
+			int at = y * SCREEN_WIDTH + c * 16;
+
+			// 16个像素的位展开为每像素一字节的掩码
+			uint64_t hi = (row >> (56 - c * 16)) & 0xFF;
+			uint64_t lo = (row >> (48 - c * 16)) & 0xFF;
+			__m128i bits = _mm_set_epi64x((long long)(lo * 0x0101010101010101ull), (long long)(hi * 0x0101010101010101ull));
+			__m128i lit = _mm_cmpeq_epi8(_mm_and_si128(bits, select), select);
+
+			// 熄灭的像素衰减, 点亮的像素为255
+			__m128i i = _mm_load_si128((const __m128i*)(intensity + at));
+			i = _mm_or_si128(_mm_subs_epu8(i, decay), lit);
+			_mm_store_si128((__m128i*)(intensity + at), i);
+
+			// 记录介于0与255之间的亮度
+			__m128i settled = _mm_or_si128(_mm_cmpeq_epi8(i, zero), _mm_cmpeq_epi8(i, full));
+			partial = _mm_or_si128(partial, _mm_andnot_si128(settled, full));
+
+			// 按16位计算灰度, 灰度 = bg - (bg - FG) * (i + 1) / 256
+			// i为255时恰好为FG, 为0时恰好为bg
+			__m128i bg = _mm_load_si128((const __m128i*)(background + at));
+			__m128i bg_lo = _mm_unpacklo_epi8(bg, zero);
+			__m128i bg_hi = _mm_unpackhi_epi8(bg, zero);
+			__m128i i_lo = _mm_add_epi16(_mm_unpacklo_epi8(i, zero), one);
+			__m128i i_hi = _mm_add_epi16(_mm_unpackhi_epi8(i, zero), one);
+			__m128i g_lo = _mm_sub_epi16(bg_lo, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(bg_lo, fg), i_lo), 8));
+			__m128i g_hi = _mm_sub_epi16(bg_hi, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(bg_hi, fg), i_hi), 8));
+			__m128i g = _mm_packus_epi16(g_lo, g_hi);
+
+			// 灰度复制到R,G,B并补上不透明的A
+			__m128i gg_lo = _mm_unpacklo_epi8(g, g);
+			__m128i gg_hi = _mm_unpackhi_epi8(g, g);
+			__m128i* out = (__m128i*)(rgba + at);
+			_mm_store_si128(out + 0, _mm_or_si128(_mm_unpacklo_epi16(gg_lo, gg_lo), alpha));
+			_mm_store_si128(out + 1, _mm_or_si128(_mm_unpackhi_epi16(gg_lo, gg_lo), alpha));
+			_mm_store_si128(out + 2, _mm_or_si128(_mm_unpacklo_epi16(gg_hi, gg_hi), alpha));
+			_mm_store_si128(out + 3, _mm_or_si128(_mm_unpackhi_epi16(gg_hi, gg_hi), alpha));
+		}
+	}
+
+	fading = _mm_movemask_epi8(partial) != 0;
+	last_hash = hash;
+	valid = true;
+	return true;
+}
+
+#else
+
+// 同SSE2版本的灰度计算
+static inline byte shade(byte bg, byte i) { return (byte)(bg - (((bg - FG) * (i + 1)) >> 8)); }
+
+bool display_t::update(const uint64_t* vram, uint64_t hash)
+{
+	if (valid && !fading && hash == last_hash)
+		return false;
+
+	bool partial = false;
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+	{
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+		{
+			int at = y * SCREEN_WIDTH + x;
+
+			byte i = intensity[at];
+			i = i > DISPLAY_DECAY ? i - DISPLAY_DECAY : 0;
+			if ((vram[y] >> (SCREEN_WIDTH - 1 - x)) & 1)
+				i = 0xFF;
+			intensity[at] = i;
+			partial |= i != 0 && i != 0xFF;
+
+			uint32_t g = shade(background[at], i);
+			rgba[at] = ALPHA | g << 16 | g << 8 | g;
+		}
+	}
+
+	fading = partial;
+	last_hash = hash;
+	valid = true;
+	return true;
+}
+
+#endif
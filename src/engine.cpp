@@ -0,0 +1,57 @@
+#include "engine.h"
+
+#include <cstring>
+
+using namespace chip8;
+
+static const char* ENGINE_NAMES[ENGINE_COUNT] = {"ref", "predecode", "jit"};
+
+const char* chip8::engine_str(engine_t e) { return e >= 0 && e < ENGINE_COUNT ? ENGINE_NAMES[e] : "unknown"; }
+
+bool chip8::engine_from_str(const char* name, engine_t* e)
+{
+	for (int i = 0; i < ENGINE_COUNT; i++)
+	{
+		if (!std::strcmp(name, ENGINE_NAMES[i]))
+		{
+			*e = (engine_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+runner_t::runner_t(machine_t& m, engine_t e) : m(m), e(e), pre(nullptr), jit(nullptr)
+{
+	if (e == ENGINE_PREDECODE)
+		pre = new predecoded_t(m);
+	else if (e == ENGINE_JIT)
+		jit = new jit_t(m);
+}
+
+runner_t::~runner_t()
+{
+	delete pre;
+	delete jit;
+}
+
+int runner_t::run(int n)
+{
+	switch (e)
+	{
+		case ENGINE_PREDECODE:
+			return pre->run(n);
+		case ENGINE_JIT:
+			return jit->run(n);
+		default:
+			return m.run_for(n);
+	}
+}
+
+void runner_t::invalidate()
+{
+	if (pre)
+		pre->invalidate_all();
+	if (jit)
+		jit->invalidate_all();
+}
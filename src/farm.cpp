@@ -0,0 +1,470 @@
+// chip9-farm: 多进程批量运行器
+// 用法: chip9-farm <job file> [--workers N] [--engine ref|predecode|jit]
+// 任务文件每行一个任务: <rom> <cycles> [movie], cycles为0时执行到录像结束, #开始的行为注释
+// 协调进程装载并校验全部任务后派生工作进程, 通过共享内存中每个工作进程一对环形队列分发任务编号并收回结果
+// 工作进程崩溃或被杀死时, 协调进程收回它已完成的结果, 重新派生工作进程并重新分配它未完成的任务
+// 结果按任务顺序输出, 包括显存散列, 最终寄存器与执行时间
+#include "chip8.h"
+#include "common.h"
+#include "engine.h"
+#include "movie.h"
+#include "spsc.h"
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace chip8;
+
+using farm_clock = std::chrono::steady_clock;
+
+// 每个工作进程同时持有的任务数, 执行完一个时下一个已经在队列中
+constexpr int WORKER_DEPTH = 2;
+constexpr size_t RING_SIZE = 8;
+
+// 一个任务导致崩溃的次数达到此值后不再重试
+constexpr int MAX_CRASHES = 3;
+
+// 发给工作进程的退出命令
+constexpr uint32_t JOB_STOP = UINT32_MAX;
+
+// 队列为空时等待的时间
+constexpr int POLL_US = 100;
+
+struct job_t
+{
+	std::string rom_path;
+	std::vector<byte> rom;
+	uint64_t cycles;
+	bool has_movie;
+	movie_t movie;
+};
+
+// 工作进程返回的结果, 放在共享内存中, 只包含定长字段
+struct farm_result_t
+{
+	uint32_t job;
+	uint32_t state;
+	uint64_t cycles;
+	uint64_t hash;
+	uint64_t frame_hash;
+	uint64_t ns;
+	word PC;
+	word I;
+	byte reg[16];
+	byte dt;
+	byte st;
+};
+
+// 协调进程与一个工作进程之间的通道
+// 两个队列各只有一个生产者与一个消费者, 位于进程间共享的匿名映射中
+struct channel_t
+{
+	spsc_queue_t<uint32_t, RING_SIZE> jobs;
+	spsc_queue_t<farm_result_t, RING_SIZE> results;
+	// 工作进程正在执行的任务, 崩溃时只归咎于这个任务, 队列中尚未开始的任务不受牵连
+	std::atomic<uint32_t> running{JOB_STOP};
+};
+
+struct worker_t
+{
+	pid_t pid;
+	// 已派发而未收到结果的任务数
+	int outstanding;
+	uint64_t jobs;
+	uint64_t busy_ns;
+	int restarts;
+};
+
+static bool load_movie(job_t& j, const char* path)
+{
+	if (!j.movie.load(path))
+		return false;
+
+	static machine_t m{};
+	m.reset(j.rom.data(), (int)j.rom.size(), nullptr, 0, 0);
+	if (!j.movie.apply(m))
+		return false;
+
+	j.has_movie = true;
+	if (!j.cycles)
+		j.cycles = j.movie.length;
+	return true;
+}
+
+// 读取任务文件, 在派生工作进程之前装载全部卡带与录像, 工作进程继承这些内容
+static bool load_jobs(const char* path, std::vector<job_t>& jobs)
+{
+	FILE* f = std::fopen(path, "r");
+	if (!f)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	char line[1024];
+	int n = 0;
+	bool ok = true;
+	while (ok && std::fgets(line, sizeof(line), f))
+	{
+		n++;
+		char rom[512], movie[512];
+		unsigned long long cycles;
+		int fields = std::sscanf(line, " %511s %llu %511s", rom, &cycles, movie);
+		if (fields <= 0 || rom[0] == '#')
+			continue;
+		if (fields < 2 || (!cycles && fields < 3))
+		{
+			std::printf("Error: %s:%d: expected <rom> <cycles> [movie]\n", path, n);
+			ok = false;
+			break;
+		}
+
+		job_t j{};
+		j.rom_path = rom;
+		j.cycles = cycles;
+
+		byte buffer[MEM_SIZE];
+		int len = MEM_SIZE - PROG_MEM_OFFSET;
+		static machine_t m{};
+		if (!load_file(rom, buffer, &len) || !m.reset(buffer, len, nullptr, 0, 0))
+		{
+			std::printf("Error: %s:%d: invalid rom %s\n", path, n, rom);
+			ok = false;
+			break;
+		}
+		j.rom.assign(buffer, buffer + len);
+
+		if (fields == 3 && !load_movie(j, movie))
+		{
+			ok = false;
+			break;
+		}
+		jobs.push_back(std::move(j));
+	}
+	std::fclose(f);
+	return ok;
+}
+
+static void run_job(const job_t& j, engine_t e, uint32_t id, farm_result_t* r)
+{
+	static machine_t m{};
+	m.reset(j.rom.data(), (int)j.rom.size(), nullptr, 0, 0);
+	if (j.has_movie)
+		j.movie.apply(m);
+
+	auto t0 = farm_clock::now();
+	runner_t run(m, e);
+	size_t next = 0;
+	while (m.cycles < j.cycles && !m.halted())
+	{
+		uint64_t until = j.cycles;
+		if (j.has_movie)
+		{
+			const std::vector<movie_event_t>& events = j.movie.events;
+			for (; next < events.size() && events[next].cycle <= m.cycles; next++)
+				m.set_key_state(events[next].key, events[next].pressed);
+			if (next < events.size() && events[next].cycle < until)
+				until = events[next].cycle;
+		}
+		// 每次至多执行INT_MAX个周期, 超过int范围的预算分多次执行
+		uint64_t left = until - m.cycles;
+		run.run(left > INT_MAX ? INT_MAX : (int)left);
+	}
+
+	r->job = id;
+	r->state = m.state;
+	r->cycles = m.cycles;
+	r->hash = m.hash_vram();
+	r->frame_hash = m.frame_hash;
+	r->ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(farm_clock::now() - t0).count();
+	r->PC = m.PC;
+	r->I = m.I;
+	std::memcpy(r->reg, m.reg, sizeof(r->reg));
+	r->dt = m.dt;
+	r->st = m.st;
+}
+
+// 工作进程的主循环, 只通过通道与协调进程交互, 从不返回
+static void worker_main(channel_t* ch, const std::vector<job_t>& jobs, engine_t e, pid_t coordinator)
+{
+	for (;;)
+	{
+		uint32_t id;
+		if (!ch->jobs.pop(&id))
+		{
+			// 协调进程已经退出
+			if (getppid() != coordinator)
+				_exit(1);
+			std::this_thread::sleep_for(std::chrono::microseconds(POLL_US));
+			continue;
+		}
+		if (id == JOB_STOP)
+			_exit(0);
+
+		ch->running.store(id, std::memory_order_release);
+		farm_result_t r;
+		run_job(jobs[id], e, id, &r);
+		// 协调进程在派发前保证队列有空位
+		while (!ch->results.push(r))
+			std::this_thread::sleep_for(std::chrono::microseconds(POLL_US));
+		ch->running.store(JOB_STOP, std::memory_order_release);
+	}
+}
+
+static pid_t spawn(channel_t* ch, const std::vector<job_t>& jobs, engine_t e)
+{
+	// 重新派生时通道中可能残留崩溃的进程没有取走的内容
+	ch->~channel_t();
+	new (ch) channel_t();
+
+	// 子进程不能继承未写出的输出
+	std::fflush(stdout);
+	pid_t coordinator = getpid();
+	pid_t pid = ::fork();
+	if (pid == 0)
+		worker_main(ch, jobs, e, coordinator);
+	if (pid < 0)
+		std::printf("Error: Could not fork worker\n");
+	return pid;
+}
+
+static void usage(const char* name)
+{
+	std::printf("usage: %s <job file> [--workers N] [--engine ref|predecode|jit]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+	const char* job_file = nullptr;
+	int nworkers = 0;
+	engine_t engine = ENGINE_REF;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (!std::strcmp(arg, "--workers") && has_value)
+			nworkers = std::atoi(argv[++i]);
+		else if (!std::strcmp(arg, "--engine") && has_value)
+		{
+			if (!engine_from_str(argv[++i], &engine))
+			{
+				std::printf("Error: unknown engine %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (arg[0] != '-' && !job_file)
+			job_file = arg;
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!job_file)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<job_t> jobs;
+	if (!load_jobs(job_file, jobs))
+		return 1;
+
+	if (nworkers <= 0)
+		nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0)
+		nworkers = 1;
+	if (nworkers > (int)jobs.size())
+		nworkers = jobs.size() ? (int)jobs.size() : 1;
+
+	// 队列的原子变量必须是无锁的, 才能在进程之间使用
+	std::atomic<size_t> probe(0);
+	if (!probe.is_lock_free())
+	{
+		std::printf("Error: Lock-free atomics are required\n");
+		return 1;
+	}
+
+	void* shm = mmap(nullptr, sizeof(channel_t) * nworkers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+	{
+		std::printf("Error: Could not map shared memory\n");
+		return 1;
+	}
+	channel_t* channels = (channel_t*)shm;
+	for (int w = 0; w < nworkers; w++)
+		new (&channels[w]) channel_t();
+
+	std::vector<worker_t> workers(nworkers);
+	std::vector<farm_result_t> results(jobs.size());
+	// 任务当前所在的工作进程, -1为未派发, -2为已完成或放弃
+	std::vector<int> owner(jobs.size(), -1);
+	std::vector<int> crashes(jobs.size(), 0);
+	std::deque<uint32_t> pending;
+	for (uint32_t i = 0; i < jobs.size(); i++)
+		pending.push_back(i);
+
+	auto t0 = farm_clock::now();
+	for (int w = 0; w < nworkers; w++)
+	{
+		workers[w] = {spawn(&channels[w], jobs, engine), 0, 0, 0, 0};
+		if (workers[w].pid < 0)
+			return 1;
+	}
+
+	size_t done = 0;
+	while (done < jobs.size())
+	{
+		bool progress = false;
+
+		for (int w = 0; w < nworkers; w++)
+		{
+			worker_t& wk = workers[w];
+			farm_result_t r;
+			while (channels[w].results.pop(&r))
+			{
+				results[r.job] = r;
+				owner[r.job] = -2;
+				wk.outstanding--;
+				wk.jobs++;
+				wk.busy_ns += r.ns;
+				done++;
+				progress = true;
+			}
+		}
+
+		// 逐层补满, 任务少时也平均分给所有工作进程
+		for (int depth = 1; depth <= WORKER_DEPTH && !pending.empty(); depth++)
+		{
+			for (int w = 0; w < nworkers && !pending.empty(); w++)
+			{
+				worker_t& wk = workers[w];
+				uint32_t id = pending.front();
+				if (wk.outstanding >= depth || !channels[w].jobs.push(id))
+					continue;
+				pending.pop_front();
+				owner[id] = w;
+				wk.outstanding++;
+				progress = true;
+			}
+		}
+
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			int w = 0;
+			while (w < nworkers && workers[w].pid != pid)
+				w++;
+			if (w == nworkers)
+				continue;
+
+			worker_t& wk = workers[w];
+			if (WIFSIGNALED(status))
+				std::fprintf(stderr, "worker %d (pid %d) killed by signal %d\n", w, (int)pid, WTERMSIG(status));
+			else
+				std::fprintf(stderr, "worker %d (pid %d) exited with %d\n", w, (int)pid, WEXITSTATUS(status));
+
+			// 收回崩溃之前已经写入的结果
+			farm_result_t r;
+			while (channels[w].results.pop(&r))
+			{
+				results[r.job] = r;
+				owner[r.job] = -2;
+				wk.jobs++;
+				wk.busy_ns += r.ns;
+				done++;
+			}
+
+			// 结果已经收回的任务不算崩溃
+			uint32_t running = channels[w].running.load(std::memory_order_acquire);
+			if (running != JOB_STOP && owner[running] == w)
+				crashes[running]++;
+
+			// 其余任务重新排队, 多次导致崩溃的任务放弃
+			for (uint32_t i = 0; i < jobs.size(); i++)
+			{
+				if (owner[i] != w)
+					continue;
+				if (crashes[i] >= MAX_CRASHES)
+				{
+					owner[i] = -2;
+					results[i].job = JOB_STOP;
+					done++;
+				}
+				else
+				{
+					owner[i] = -1;
+					pending.push_front(i);
+				}
+			}
+
+			wk.outstanding = 0;
+			wk.restarts++;
+			wk.pid = spawn(&channels[w], jobs, engine);
+			if (wk.pid < 0)
+				return 1;
+			progress = true;
+		}
+
+		if (!progress)
+			std::this_thread::sleep_for(std::chrono::microseconds(POLL_US));
+	}
+	double seconds = std::chrono::duration<double>(farm_clock::now() - t0).count();
+
+	for (int w = 0; w < nworkers; w++)
+	{
+		while (!channels[w].jobs.push(JOB_STOP))
+			std::this_thread::sleep_for(std::chrono::microseconds(POLL_US));
+	}
+	for (int w = 0; w < nworkers; w++)
+		waitpid(workers[w].pid, nullptr, 0);
+
+	int failed = 0;
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < jobs.size(); i++)
+	{
+		const farm_result_t& r = results[i];
+		if (r.job == JOB_STOP)
+		{
+			std::printf("job=%u rom=%s error=crashed crashes=%d\n", i, jobs[i].rom_path.c_str(), crashes[i]);
+			failed++;
+			continue;
+		}
+
+		char regs[33];
+		for (int k = 0; k < 16; k++)
+			std::snprintf(regs + k * 2, 3, "%02X", r.reg[k]);
+		std::printf("job=%u rom=%s hash=%016" PRIX64 " frame=%016" PRIX64 " cycles=%" PRIu64
+					" state=%s pc=%03X i=%03X v=%s dt=%u st=%u ms=%.3f\n",
+			i, jobs[i].rom_path.c_str(), r.hash, r.frame_hash, r.cycles, state_str((state_t)r.state), r.PC, r.I, regs,
+			r.dt, r.st, r.ns / 1e6);
+		total += r.cycles;
+	}
+
+	for (int w = 0; w < nworkers; w++)
+		std::printf("worker=%d jobs=%" PRIu64 " restarts=%d utilisation=%.3f\n", w, workers[w].jobs,
+			workers[w].restarts, workers[w].busy_ns / 1e9 / seconds);
+	std::printf("jobs=%zu failed=%d workers=%d cycles=%" PRIu64 " seconds=%.6f mips=%.3f\n", jobs.size(), failed,
+		nworkers, total, seconds, total / seconds / 1e6);
+
+	munmap(shm, sizeof(channel_t) * nworkers);
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,126 @@
+#include "fork.h"
+
+#include <cstring>
+
+using namespace chip8;
+
+void chip8::fork(const machine_t& parent, machine_t* child)
+{
+	std::memcpy(child, &parent, sizeof(machine_t));
+	child->profile = nullptr;
+	child->trace = nullptr;
+}
+
+int chip8::run_frames(machine_t& m, word keys, int frames)
+{
+	for (int i = 0; i < 16; i++)
+		m.set_key_state(i, (keys >> i) & 1);
+
+	int done = 0;
+	for (; done < frames && !m.halted(); done++)
+	{
+		uint64_t frame = m.ticks;
+		while (m.ticks == frame && !m.halted())
+			m.run_frame();
+	}
+	return done;
+}
+
+fork_pool_t::fork_pool_t(int threads) : generation(0), stopping(false), job{}, next(0), busy(0)
+{
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+
+	for (int i = 1; i < threads; i++)
+		workers.emplace_back(&fork_pool_t::worker_loop, this);
+}
+
+fork_pool_t::~fork_pool_t()
+{
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		stopping = true;
+	}
+	cv.notify_all();
+
+	for (std::thread& t : workers)
+		t.join();
+}
+
+void fork_pool_t::explore(const machine_t& parent, const std::vector<word>& keys, int frames,
+	std::vector<machine_t>& children, std::vector<uint64_t>& hashes)
+{
+	children.resize(keys.size());
+	hashes.resize(keys.size());
+	run_job({&parent, children.data(), keys.data(), hashes.data(), frames, keys.size()});
+}
+
+void fork_pool_t::step(std::vector<machine_t>& machines, const std::vector<word>& keys, int frames,
+	std::vector<uint64_t>& hashes)
+{
+	size_t count = machines.size() < keys.size() ? machines.size() : keys.size();
+	hashes.resize(count);
+	run_job({nullptr, machines.data(), keys.data(), hashes.data(), frames, count});
+}
+
+void fork_pool_t::run_job(const job_t& j)
+{
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		// 迟到的工作线程可能仍持有上一批任务
+		cv.wait(lk, [this] { return busy == 0; });
+		job = j;
+		next = 0;
+		generation++;
+		busy++;
+	}
+	cv.notify_all();
+
+	work(j);
+
+	// 等待仍在执行的工作线程
+	std::unique_lock<std::mutex> lk(lock);
+	busy--;
+	cv.wait(lk, [this] { return busy == 0; });
+}
+
+void fork_pool_t::work(const job_t& j)
+{
+	for (;;)
+	{
+		size_t i = next.fetch_add(1);
+		if (i >= j.count)
+			break;
+
+		machine_t& m = j.machines[i];
+		if (j.parent)
+			fork(*j.parent, &m);
+		run_frames(m, j.keys[i], j.frames);
+		j.hashes[i] = m.frame_hash;
+	}
+}
+
+void fork_pool_t::worker_loop()
+{
+	uint64_t seen = 0;
+
+	std::unique_lock<std::mutex> lk(lock);
+	for (;;)
+	{
+		cv.wait(lk, [&] { return stopping || generation != seen; });
+		if (stopping)
+			return;
+
+		// 在锁内复制任务, run_job在所有工作线程退出当前批次之前不会替换它
+		seen = generation;
+		job_t j = job;
+		busy++;
+		lk.unlock();
+
+		work(j);
+
+		lk.lock();
+		if (!--busy)
+			cv.notify_all();
+	}
+}
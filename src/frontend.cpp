@@ -0,0 +1,321 @@
+// 连接chip8核心与后端的胶水代码
+// 负责装载卡带, 驱动机器运行并把显存与按键同步到后端
+// 机器只由模拟线程驱动, 画面经三重缓冲交给渲染线程, 声音逐帧交给后端的音频缓冲
+#include "audio.h"
+#include "chip8.h"
+#include "common.h"
+#include "display.h"
+#include "movie.h"
+#include "rewind.h"
+#include "spsc.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace chip8;
+
+// 前端驱动的机器实例
+static machine_t machine{};
+
+// 执行轨迹
+static trace_writer_t trace;
+
+// 每个虚拟帧结束时保存的历史状态
+static rewind_t history;
+
+// 即时存档
+static snapshot_t saved_state;
+static bool has_saved_state = false;
+
+// 上次同步到机器的按键状态
+static key_state_t synced_keys[16]{};
+
+// 输入录像, 录制与回放不会同时进行
+static movie_t movie;
+static const char* movie_path = nullptr;
+static bool recording = false;
+static bool playing = false;
+// 回放中下一个要注入的事件
+static size_t movie_next = 0;
+
+// 一个虚拟帧结束时的画面
+struct frame_t
+{
+	uint64_t vram[SCREEN_HEIGHT];
+	uint64_t hash;
+};
+
+// 模拟线程发布, 渲染线程取走
+static triple_buffer_t<frame_t> published;
+
+// 渲染线程的荧光屏模拟, 把画面展开为RGBA
+static display_t display;
+
+// 模拟线程的蜂鸣器与一帧的采样
+static tone_t tone;
+static int16_t frame_samples[MAX_FRAME_SAMPLES];
+
+// 调试打印
+void print_bytes(const byte* dat, int len)
+{
+	for (int i = 0; i < len; i++)
+		std::printf("%02X ", dat[i]);
+	std::printf("\n");
+}
+
+// 发布机器当前的画面
+static void publish_frame()
+{
+	frame_t& f = published.write_buffer();
+	std::memcpy(f.vram, machine.vram, sizeof(f.vram));
+	f.hash = machine.frame_hash;
+	published.publish();
+
+	// 画面的变化由渲染线程比较得出
+	machine.take_dirty_rows();
+}
+
+const char* state_str()
+{
+	static char _buf[100]{};
+
+	std::snprintf(_buf, sizeof(_buf), "st:%3d,dt:%3d,state:%s", machine.st, machine.dt,
+		chip8::state_str(machine.state));
+	_buf[sizeof(_buf) - 1] = 0;
+
+	return _buf;
+}
+
+void start(const char* file_path)
+{
+	byte buffer[MEM_SIZE]{};
+	int len = sizeof(buffer);
+
+	if (!load_file(file_path, buffer, &len))
+	{
+		std::printf("rom %s load faild\n", file_path);
+		exit(-1);
+	}
+
+	// 初始化cpu并清空ram/寄存器组
+	if (!machine.reset(buffer, len, nullptr, 0, 0))
+	{
+		std::printf("rom %s invaild. len: %d\n", file_path, len);
+		exit(-1);
+	}
+
+	history.clear();
+	has_saved_state = false;
+	publish_frame();
+
+	std::printf("rom %s load done. len: %d\n", file_path, len);
+}
+
+// 改变机器中一个键的状态, 录制时记下实际发生的变化
+static void set_key(int key, bool pressed)
+{
+	bool was = (machine.keys >> key) & 1;
+	machine.set_key_state(key, pressed);
+	if (recording && was != pressed)
+		movie.record(machine.cycles, key, pressed);
+}
+
+// 将后端的按键状态同步到机器
+static void sync_keys()
+{
+	for (int i = 0; i < 16; i++)
+	{
+		key_state_t k = get_key(i);
+
+		// 在同一轮事件中按下又松开的键只会以RELEASE出现
+		// 补一次按下以便机器记录到松开, 一轮事件中执行多帧时只补一次
+		if (k == key_state_t::RELEASE && synced_keys[i] != key_state_t::RELEASE)
+			set_key(i, true);
+
+		set_key(i, k == key_state_t::PRESSED);
+		synced_keys[i] = k;
+	}
+}
+
+// 注入回放中已经到期的按键, 返回在下一个事件之前至多可以执行的周期数, 不超过n
+static int play_keys(int n)
+{
+	const std::vector<movie_event_t>& events = movie.events;
+	for (; movie_next < events.size() && events[movie_next].cycle <= machine.cycles; movie_next++)
+		machine.set_key_state(events[movie_next].key, events[movie_next].pressed);
+
+	if (movie_next < events.size() && events[movie_next].cycle - machine.cycles < (uint64_t)n)
+		return (int)(events[movie_next].cycle - machine.cycles);
+
+	// 回放结束后恢复实时输入
+	if (movie_next == events.size() && machine.cycles >= movie.length)
+	{
+		playing = false;
+		std::printf("movie playback finished at cycle %llu\n", (unsigned long long)machine.cycles);
+	}
+	return n;
+}
+
+// 机器状态被倒回之后, 录像从同一周期继续
+static void seek_movie()
+{
+	if (recording)
+		movie.truncate(machine.cycles);
+	if (playing)
+		movie_next = movie.seek(machine.cycles);
+}
+
+void set_clock(uint32_t ips) { machine.set_clock(ips); }
+
+void set_vblank_wait(bool on) { machine.set_quirks(on ? (uint32_t)QUIRK_VBLANK_WAIT : 0); }
+
+void set_seed(uint32_t seed) { machine.seed_rng(seed); }
+
+bool record_movie(const char* path)
+{
+	if (playing || !movie.begin(machine))
+		return false;
+
+	movie_path = path;
+	recording = true;
+	return true;
+}
+
+bool play_movie(const char* path)
+{
+	if (recording || !movie.load(path) || !movie.apply(machine))
+		return false;
+
+	movie_next = 0;
+	playing = true;
+	return true;
+}
+
+bool stop_movie()
+{
+	playing = false;
+	if (!recording)
+		return true;
+
+	recording = false;
+	movie.length = machine.cycles;
+	return movie.save(movie_path);
+}
+
+void present()
+{
+	// 没有新的画面时仍以上一帧更新, 推进淡出
+	published.acquire();
+	const frame_t& f = published.read_buffer();
+	if (display.update(f.vram, f.hash))
+		screen_present(display.pixels());
+}
+
+bool set_trace(const char* path)
+{
+	machine.trace = nullptr;
+	trace.close();
+
+	if (!path)
+		return true;
+	if (!trace.open(path))
+		return false;
+
+	machine.trace = &trace;
+	return true;
+}
+
+bool rewind_frames(int frames)
+{
+	if (frames <= 0 || !history.restore(machine, frames))
+		return false;
+
+	// 从倒回的位置继续运行, 丢弃之后的历史
+	history.drop(frames);
+	seek_movie();
+	publish_frame();
+	return true;
+}
+
+void save_state()
+{
+	machine.snapshot(&saved_state);
+	has_saved_state = true;
+}
+
+bool load_state()
+{
+	if (!has_saved_state)
+		return false;
+
+	machine.restore(saved_state);
+	seek_movie();
+	publish_frame();
+	return true;
+}
+
+bool waiting_input()
+{
+	if (machine.halted())
+		return true;
+
+	// 回放中的按键不需要等待
+	if (playing)
+		return false;
+
+	// 计时器仍在递减时, 蜂鸣与之后读到的delay_timer取决于经过的时间
+	return machine.idle() == IDLE_INPUT && !machine.dt && !machine.st;
+}
+
+// 执行一个60hz的虚拟帧
+bool update()
+{
+	// 死循环或出错后停机
+	if (machine.halted())
+		return false;
+
+	// 回放时忽略实时按键
+	if (!playing)
+		sync_keys();
+
+	uint64_t frame = machine.ticks;
+	uint64_t sound = machine.sound_ticks;
+	while (machine.ticks == frame)
+	{
+		int n = (int)(machine.next_tick - machine.cycles);
+		if (playing)
+			n = play_keys(n);
+		machine.run_for(n);
+
+		// 绘制不会中断执行, 画面在帧结束时统一发布
+		// 停机时发布最后的画面并退出
+		switch (machine.state)
+		{
+			case STATE_INFINITE_LOOP: {
+				std::printf("INFINITE LOOP\n");
+				publish_frame();
+				return false;
+			}
+			case STATE_NOT_IMPL:
+			case STATE_ERROR_STAKE_FULL:
+			case STATE_ERROR_POP_EMPTY_STAKC: {
+				std::printf("ERROR: %s, PC=%04X,IR=%04X\n", chip8::state_str(machine.state), machine.PC - 2,
+					machine.IR);
+				publish_frame();
+				return false;
+			}
+			default:
+				break;
+		}
+	}
+
+	// 本帧的声音, 宿主跟不上时由后端丢弃
+	audio_queue(frame_samples, tone.render_frame(machine.sound_ticks != sound, frame_samples));
+
+	history.push(machine);
+	publish_frame();
+	return true;
+}
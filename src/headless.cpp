@@ -0,0 +1,460 @@
+// chip9-headless: 不依赖窗口与音频的批量运行器
+// 用法:
+//   chip9-headless <rom> [--cycles N] [--engine ref|predecode|jit] [--input script] [--key c:k:d|u] [--dump]
+//                  [--profile prefix] [--trace file] [--vblank] [--wav file] [--seed N] [--record movie]
+//                  [--play movie]
+//   chip9-headless --golden <data dir>
+// 按脚本注入按键, 执行N个周期后输出显存散列, --golden对自带的测试卡带在每种引擎以及构建时翻译的run_aot上比对预期散列
+// --wav把蜂鸣器的声音逐帧写入WAV文件, 内容只取决于卡带与输入, 可以逐采样比较
+// --record把这次运行保存为输入录像, --play回放录像, 没有指定--cycles时执行到录像结束
+#include "aot.h"
+#include "audio.h"
+#include "chip8.h"
+#include "common.h"
+#include "engine.h"
+#include "movie.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace chip8;
+
+constexpr uint64_t DEFAULT_CYCLES = 10000;
+
+// 由构建生成, 返回data中的卡带经chip9-aot翻译得到的程序, 没有时返回nullptr
+const aot_program_t* find_aot_program(const char* file);
+
+// 以翻译后的代码驱动一台机器, 接口与runner_t相同
+struct aot_runner_t
+{
+	machine_t& m;
+	const aot_program_t& prog;
+
+	int run(int n) { return run_aot(m, prog, n); }
+	machine_t& machine() { return m; }
+};
+
+// 在指定周期改变一个键的状态
+struct key_event_t
+{
+	uint64_t cycle;
+	byte key;
+	bool pressed;
+};
+
+// 自带测试卡带的预期结果
+struct golden_t
+{
+	const char* file;
+	uint64_t cycles;
+	// 与--input相同的脚本格式, 以;分行
+	const char* input;
+	uint64_t hash;
+};
+
+// 散列由参考实现生成, 只要参考实现的行为发生变化就需要重新生成
+static const golden_t GOLDEN[] = {
+	{"1-chip8-logo.ch8", 2000, "", 0x2779B329DD6A179Eull},
+	{"2-ibm-logo.ch8", 2000, "", 0x8AFBF4CF4F9CF146ull},
+	{"3-corax+.ch8", 10000, "", 0x6B93AF0C74789D12ull},
+	{"4-flags.ch8", 20000, "", 0xC46FE129F9C54965ull},
+	// 菜单中选择CHIP-8平台
+	{"5-quirks.ch8", 200000, "20000 1 down;22000 1 up", 0x18201AEABE1CB5A2ull},
+	// 菜单中选择FX0A测试, 之后按下并松开A
+	{"6-keypad.ch8", 60000, "20000 3 down;22000 3 up;40000 A down;42000 A up", 0x3785C0B45DCEACE2ull},
+	// 按住B时蜂鸣
+	{"7-beep.ch8", 20000, "5000 B down", 0xEDF030C99FBA498Dull},
+};
+
+// 解析一行脚本: <周期> <键, 十六进制> <down|up>, #之后为注释
+// 空行返回true且不写入事件
+static bool parse_event(const char* line, std::vector<key_event_t>& out)
+{
+	std::string s(line);
+	size_t hash = s.find('#');
+	if (hash != std::string::npos)
+		s.resize(hash);
+
+	unsigned long long cycle;
+	unsigned key;
+	char action[8];
+	int n = std::sscanf(s.c_str(), "%llu %x %7s", &cycle, &key, action);
+	if (n <= 0)
+		return true;
+	if (n != 3 || key > 0xF)
+		return false;
+
+	bool pressed;
+	if (!std::strcmp(action, "down"))
+		pressed = true;
+	else if (!std::strcmp(action, "up"))
+		pressed = false;
+	else
+		return false;
+
+	out.push_back({(uint64_t)cycle, (byte)key, pressed});
+	return true;
+}
+
+// 解析以sep分隔的多行脚本
+static bool parse_script(const char* text, char sep, std::vector<key_event_t>& out)
+{
+	std::string s(text);
+	size_t begin = 0;
+	while (begin <= s.size())
+	{
+		size_t end = s.find(sep, begin);
+		if (end == std::string::npos)
+			end = s.size();
+
+		std::string line = s.substr(begin, end - begin);
+		if (!parse_event(line.c_str(), out))
+		{
+			std::printf("Error: bad input line \"%s\"\n", line.c_str());
+			return false;
+		}
+		begin = end + 1;
+	}
+	return true;
+}
+
+static bool load_script(const char* path, std::vector<key_event_t>& out)
+{
+	FILE* f = std::fopen(path, "r");
+	if (!f)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	std::string text;
+	char buf[256];
+	size_t n;
+	while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+		text.append(buf, n);
+	std::fclose(f);
+
+	return parse_script(text.c_str(), '\n', out);
+}
+
+static bool load_rom(const char* path, machine_t& m)
+{
+	byte buffer[MEM_SIZE]{};
+	int len = sizeof(buffer);
+
+	if (!load_file(path, buffer, &len))
+		return false;
+
+	if (!m.reset(buffer, len, nullptr, 0, 0))
+	{
+		std::printf("rom %s invaild. len: %d\n", path, len);
+		return false;
+	}
+	return true;
+}
+
+// 执行到第cycles个周期或停机为止, events需按周期排序
+// tone不为空时每个虚拟帧结束后生成该帧的声音追加到samples, movie不为空时记录实际注入的按键
+template <typename runner>
+static void run(runner& r, uint64_t cycles, const std::vector<key_event_t>& events, tone_t* tone = nullptr,
+	std::vector<int16_t>* samples = nullptr, movie_t* movie = nullptr)
+{
+	machine_t& m = r.machine();
+	size_t next = 0;
+	uint64_t sound = m.sound_ticks;
+
+	while (m.cycles < cycles && !m.halted())
+	{
+		while (next < events.size() && events[next].cycle <= m.cycles)
+		{
+			m.set_key_state(events[next].key, events[next].pressed);
+			if (movie)
+				movie->record(m.cycles, events[next].key, events[next].pressed);
+			next++;
+		}
+
+		uint64_t until = cycles;
+		if (next < events.size() && events[next].cycle < until)
+			until = events[next].cycle;
+		// 生成声音时在每一帧的结尾停下
+		if (tone && m.next_tick < until)
+			until = m.next_tick;
+
+		// 每次至多执行INT_MAX个周期, 超过int范围的--cycles分多次执行
+		uint64_t left = until - m.cycles;
+		uint64_t ticks = m.ticks;
+		r.run(left > INT_MAX ? INT_MAX : (int)left);
+
+		if (tone && m.ticks != ticks)
+		{
+			int16_t buf[MAX_FRAME_SAMPLES];
+			int n = tone->render_frame(m.sound_ticks != sound, buf);
+			samples->insert(samples->end(), buf, buf + n);
+			sound = m.sound_ticks;
+		}
+	}
+
+	if (movie)
+		movie->length = m.cycles;
+}
+
+static void sort_events(std::vector<key_event_t>& events)
+{
+	// 插入排序, 保持同一周期内事件的书写顺序
+	for (size_t i = 1; i < events.size(); i++)
+	{
+		key_event_t e = events[i];
+		size_t j = i;
+		for (; j > 0 && events[j - 1].cycle > e.cycle; j--)
+			events[j] = events[j - 1];
+		events[j] = e;
+	}
+}
+
+static void dump_vram(const machine_t& m)
+{
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+	{
+		char line[SCREEN_WIDTH + 1];
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+			line[x] = m.read_vram(x, y) ? '#' : '.';
+		line[SCREEN_WIDTH] = 0;
+		std::printf("%s\n", line);
+	}
+}
+
+// 比对并输出一次运行的结果
+static bool check_golden(const golden_t& g, const machine_t& m, const char* engine)
+{
+	uint64_t hash = m.hash_vram();
+	bool ok = hash == g.hash;
+
+	std::printf("%-4s %-18s %-10s hash=%016" PRIX64 " cycles=%" PRIu64 " state=%s\n", ok ? "PASS" : "FAIL", g.file,
+		engine, hash, m.cycles, state_str(m.state));
+	return ok;
+}
+
+static int run_golden(const char* dir)
+{
+	int failed = 0;
+
+	for (const golden_t& g : GOLDEN)
+	{
+		std::string path = std::string(dir) + "/" + g.file;
+
+		std::vector<key_event_t> events;
+		parse_script(g.input, ';', events);
+		sort_events(events);
+
+		for (int e = 0; e < ENGINE_COUNT; e++)
+		{
+			static machine_t m{};
+			if (!load_rom(path.c_str(), m))
+			{
+				failed++;
+				break;
+			}
+
+			runner_t r(m, (engine_t)e);
+			run(r, g.cycles, events);
+			failed += !check_golden(g, m, engine_str((engine_t)e));
+		}
+
+		// 构建时翻译的代码
+		const aot_program_t* prog = find_aot_program(g.file);
+		if (!prog)
+		{
+			std::printf("FAIL %-18s %-10s not translated\n", g.file, "aot");
+			failed++;
+			continue;
+		}
+
+		static machine_t m{};
+		if (!load_rom(path.c_str(), m))
+		{
+			failed++;
+			continue;
+		}
+		aot_runner_t r{m, *prog};
+		run(r, g.cycles, events);
+		failed += !check_golden(g, m, "aot");
+	}
+
+	std::printf("%d failed\n", failed);
+	return failed ? 1 : 0;
+}
+
+static void usage(const char* name)
+{
+	std::printf("usage: %s <rom> [--cycles N] [--engine ref|predecode|jit] [--input script] [--key cycle:key:down|up] "
+				"[--dump] [--profile prefix] [--trace file] [--vblank] [--wav file] [--seed N] [--record movie] "
+				"[--play movie]\n"
+				"       %s --golden <data dir>\n",
+		name, name);
+}
+
+int main(int argc, char** argv)
+{
+	const char* rom = nullptr;
+	uint64_t cycles = 0;
+	engine_t engine = ENGINE_REF;
+	bool dump = false;
+	bool vblank = false;
+	const char* profile_prefix = nullptr;
+	const char* trace_path = nullptr;
+	const char* wav_path = nullptr;
+	const char* record_path = nullptr;
+	const char* play_path = nullptr;
+	uint32_t seed = DEFAULT_RNG_SEED;
+	std::vector<key_event_t> events;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (!std::strcmp(arg, "--golden") && has_value)
+			return run_golden(argv[++i]);
+		else if (!std::strcmp(arg, "--cycles") && has_value)
+			cycles = std::strtoull(argv[++i], nullptr, 10);
+		else if (!std::strcmp(arg, "--engine") && has_value)
+		{
+			if (!engine_from_str(argv[++i], &engine))
+			{
+				std::printf("Error: unknown engine %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (!std::strcmp(arg, "--input") && has_value)
+		{
+			if (!load_script(argv[++i], events))
+				return 1;
+		}
+		else if (!std::strcmp(arg, "--key") && has_value)
+		{
+			// cycle:key:action
+			std::string s(argv[++i]);
+			for (char& c : s)
+				if (c == ':')
+					c = ' ';
+			if (!parse_script(s.c_str(), '\n', events))
+				return 1;
+		}
+		else if (!std::strcmp(arg, "--dump"))
+			dump = true;
+		else if (!std::strcmp(arg, "--vblank"))
+			vblank = true;
+		else if (!std::strcmp(arg, "--profile") && has_value)
+			profile_prefix = argv[++i];
+		else if (!std::strcmp(arg, "--trace") && has_value)
+			trace_path = argv[++i];
+		else if (!std::strcmp(arg, "--wav") && has_value)
+			wav_path = argv[++i];
+		else if (!std::strcmp(arg, "--seed") && has_value)
+			seed = (uint32_t)std::strtoul(argv[++i], nullptr, 0);
+		else if (!std::strcmp(arg, "--record") && has_value)
+			record_path = argv[++i];
+		else if (!std::strcmp(arg, "--play") && has_value)
+			play_path = argv[++i];
+		else if (arg[0] != '-' && !rom)
+			rom = arg;
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!rom)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	static machine_t m{};
+	if (!load_rom(rom, m))
+		return 1;
+	if (vblank)
+		m.set_quirks(QUIRK_VBLANK_WAIT);
+	m.seed_rng(seed);
+
+	// 录像中的配置与按键取代命令行中的设置
+	static movie_t movie;
+	if (play_path)
+	{
+		if (!movie.load(play_path) || !movie.apply(m))
+			return 1;
+		for (const movie_event_t& e : movie.events)
+			events.push_back({e.cycle, e.key, e.pressed});
+		if (!cycles)
+			cycles = movie.length;
+	}
+	if (!cycles)
+		cycles = DEFAULT_CYCLES;
+
+	sort_events(events);
+
+	static movie_t recording;
+	if (record_path && !recording.begin(m))
+		return 1;
+
+	static profile_t profile;
+	if (profile_prefix)
+		m.profile = &profile;
+
+	static trace_writer_t trace;
+	if (trace_path)
+	{
+		if (!trace.open(trace_path))
+			return 1;
+		m.trace = &trace;
+	}
+
+	static tone_t tone;
+	std::vector<int16_t> samples;
+
+	runner_t r(m, engine);
+	run(r, cycles, events, wav_path ? &tone : nullptr, &samples, record_path ? &recording : nullptr);
+	trace.close();
+
+	if (record_path && !recording.save(record_path))
+		return 1;
+
+	if (wav_path && !write_wav(wav_path, samples.data(), samples.size(), tone.sample_rate()))
+		return 1;
+
+	// 写出prefix.txt平面剖析与prefix.folded折叠栈
+	if (profile_prefix)
+	{
+		std::string flat = std::string(profile_prefix) + ".txt";
+		std::string folded = std::string(profile_prefix) + ".folded";
+
+		FILE* f = std::fopen(flat.c_str(), "w");
+		FILE* g = std::fopen(folded.c_str(), "w");
+		if (!f || !g)
+		{
+			std::printf("Error: Could not write profile %s\n", profile_prefix);
+			return 1;
+		}
+		profile.dump_flat(f, m);
+		profile.dump_collapsed(g);
+		std::fclose(f);
+		std::fclose(g);
+	}
+
+	if (dump)
+		dump_vram(m);
+
+	std::printf("hash=%016" PRIX64 " frame=%016" PRIX64 " cycles=%" PRIu64 " state=%s\n", m.hash_vram(), m.frame_hash,
+		m.cycles, state_str(m.state));
+
+	// 出错停机时以非零值退出, 死循环视为正常结束
+	return m.state > STATE_INFINITE_LOOP ? 2 : 0;
+}
@@ -0,0 +1,514 @@
+// x86-64基本块动态编译器
+// 客户机寄存器保存在machine_t中, 生成的代码通过固定的基址寄存器以内存操作数访问它们
+// 指令语义与machine_t::execute保持一致
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+	#define CHIP8_JIT_X64 1
+#else
+	#define CHIP8_JIT_X64 0
+#endif
+
+#if CHIP8_JIT_X64
+	#ifdef _WIN32
+		#include <windows.h>
+	#else
+		#include <sys/mman.h>
+	#endif
+#endif
+
+using namespace chip8;
+
+constexpr word ADDR_MASK = MEM_SIZE - 1;
+
+// 可执行代码缓冲的大小
+constexpr size_t CODE_SIZE = 256 * 1024;
+
+// 单个基本块的最大指令数与生成代码的上限
+constexpr int MAX_BLOCK_INSTR = 32;
+constexpr size_t MAX_BLOCK_CODE = 40 * (MAX_BLOCK_INSTR + 2);
+
+#if CHIP8_JIT_X64
+
+// 第一个参数所在的寄存器, 即machine_t的基址
+// rax与rdx在两种调用约定下均为易失寄存器, 用作临时寄存器
+	#ifdef _WIN32
+constexpr byte REG_BASE = 1; // rcx
+	#else
+constexpr byte REG_BASE = 7; // rdi
+	#endif
+constexpr byte REG_AL = 0;
+constexpr byte REG_DL = 2;
+
+static byte* alloc_code()
+{
+	#ifdef _WIN32
+	return (byte*)VirtualAlloc(nullptr, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	#else
+	void* p = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? nullptr : (byte*)p;
+	#endif
+}
+
+static void free_code(byte* p)
+{
+	#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+	#else
+	munmap(p, CODE_SIZE);
+	#endif
+}
+
+// 按字节写出机器码
+struct emitter_t
+{
+	byte* p;
+
+	void u8(int v) { *p++ = (byte)v; }
+	void u16(int v)
+	{
+		u8(v);
+		u8(v >> 8);
+	}
+	void u32(uint32_t v)
+	{
+		u16(v & 0xFFFF);
+		u16(v >> 16);
+	}
+
+	// [base + disp32]形式的内存操作数
+	void mem(byte r, size_t disp)
+	{
+		u8(0x80 | (r << 3) | REG_BASE);
+		u32((uint32_t)disp);
+	}
+
+	// 8位寄存器与内存间的运算, op为对应的/r操作码
+	void op_rm8(byte op, byte r, size_t disp)
+	{
+		u8(op);
+		mem(r, disp);
+	}
+	void load8(byte r, size_t disp) { op_rm8(0x8A, r, disp); }
+	void store8(byte r, size_t disp) { op_rm8(0x88, r, disp); }
+
+	void store8_imm(size_t disp, byte v)
+	{
+		u8(0xC6);
+		mem(0, disp);
+		u8(v);
+	}
+	void store16_imm(size_t disp, word v)
+	{
+		u8(0x66);
+		u8(0xC7);
+		mem(0, disp);
+		u16(v);
+	}
+
+	// setc/setnc dl
+	void setc_dl()
+	{
+		u16(0x920F);
+		u8(0xC2);
+	}
+	void setnc_dl()
+	{
+		u16(0x930F);
+		u8(0xC2);
+	}
+
+	void ret_count(int n)
+	{
+		u8(0xB8);
+		u32(n);
+		u8(0xC3);
+	}
+};
+
+// 寄存器在machine_t中的偏移
+static size_t reg_off(int r) { return offsetof(machine_t, reg) + r; }
+
+// 翻译单条可内联的指令, 不支持时返回false
+static bool emit_body(emitter_t& e, word ir)
+{
+	byte x = (ir & 0x0F00) >> 8;
+	byte y = (ir & 0x00F0) >> 4;
+	byte nn = ir & 0x00FF;
+
+	switch (ir & 0xF000)
+	{
+		// 6XNN: Vx=NN
+		case 0x6000:
+			e.store8_imm(reg_off(x), nn);
+			return true;
+		// 7XNN: Vx+=NN
+		case 0x7000:
+			e.u8(0x80);
+			e.mem(0, reg_off(x));
+			e.u8(nn);
+			return true;
+		// 诸算术与逻辑运算指令
+		case 0x8000: {
+			switch (ir & 0x000F)
+			{
+				// 8XY0: Vx = Vy
+				case 0:
+					e.load8(REG_AL, reg_off(y));
+					e.store8(REG_AL, reg_off(x));
+					return true;
+				// 8XY1/8XY2/8XY3: Vx |= &= ^= Vy, VF=0
+				case 1:
+				case 2:
+				case 3: {
+					static const byte ops[] = {0x0A, 0x22, 0x32};
+					e.load8(REG_AL, reg_off(x));
+					e.op_rm8(ops[(ir & 0xF) - 1], REG_AL, reg_off(y));
+					e.store8(REG_AL, reg_off(x));
+					e.store8_imm(reg_off(0xF), 0);
+					return true;
+				}
+				// 8XY4: Vx += Vy, VF=进位
+				case 4:
+					e.load8(REG_AL, reg_off(x));
+					e.op_rm8(0x02, REG_AL, reg_off(y));
+					e.setc_dl();
+					break;
+				// 8XY5: Vx -= Vy, VF=无借位
+				case 5:
+					e.load8(REG_AL, reg_off(x));
+					e.op_rm8(0x2A, REG_AL, reg_off(y));
+					e.setnc_dl();
+					break;
+				// 8XY6: Vx >>= 1, VF=移出的位
+				case 6:
+					e.load8(REG_AL, reg_off(x));
+					e.u16(0xE8D0);
+					e.setc_dl();
+					break;
+				// 8XY7: Vx = Vy - Vx, VF=无借位
+				case 7:
+					e.load8(REG_AL, reg_off(y));
+					e.op_rm8(0x2A, REG_AL, reg_off(x));
+					e.setnc_dl();
+					break;
+				// 8XYE: Vx <<= 1, VF=移出的位
+				case 0xE:
+					e.load8(REG_AL, reg_off(x));
+					e.u16(0xE0D0);
+					e.setc_dl();
+					break;
+				default:
+					return false;
+			}
+			// 先写Vx再写VF, 与参考实现在X=F时的结果一致
+			e.store8(REG_AL, reg_off(x));
+			e.store8(REG_DL, reg_off(0xF));
+			return true;
+		}
+		// ANNN: I=NNN
+		case 0xA000:
+			e.store16_imm(offsetof(machine_t, I), ir & 0x0FFF);
+			return true;
+		case 0xF000: {
+			switch (ir & 0xF0FF)
+			{
+				// FX07: Vx = delay_timer
+				case 0xF007:
+					e.load8(REG_AL, offsetof(machine_t, dt));
+					e.store8(REG_AL, reg_off(x));
+					return true;
+				// FX15: delay_timer=Vx
+				case 0xF015:
+					e.load8(REG_AL, reg_off(x));
+					e.store8(REG_AL, offsetof(machine_t, dt));
+					return true;
+				// FX18: sound_timer=Vx
+				case 0xF018:
+					e.load8(REG_AL, reg_off(x));
+					e.store8(REG_AL, offsetof(machine_t, st));
+					return true;
+				// FX1E: I+=Vx
+				case 0xF01E:
+					// movzx eax, byte [x]; add word [I], ax
+					e.u16(0xB60F);
+					e.mem(REG_AL, reg_off(x));
+					e.u16(0x0166);
+					e.mem(REG_AL, offsetof(machine_t, I));
+					return true;
+				default:
+					return false;
+			}
+		}
+		default:
+			return false;
+	}
+}
+
+// 翻译作为基本块出口的跳过或跳转指令
+// pc为该指令的地址, 不支持时返回false
+static bool emit_exit(emitter_t& e, word ir, word pc)
+{
+	byte x = (ir & 0x0F00) >> 8;
+	byte y = (ir & 0x00F0) >> 4;
+	byte nn = ir & 0x00FF;
+	word next = pc + 2;
+
+	// je/jne rel8, 跳过的是一条9字节的mov word [PC], imm16
+	byte jcc;
+	switch (ir & 0xF000)
+	{
+		// 1NNN: 无条件跳转, 自跳转交由参考实现报告死循环
+		case 0x1000:
+			if ((ir & 0x0FFF) == pc)
+				return false;
+			e.store16_imm(offsetof(machine_t, PC), ir & 0x0FFF);
+			return true;
+		// 3XNN/4XNN: cmp byte [x], nn
+		case 0x3000:
+		case 0x4000:
+			e.store16_imm(offsetof(machine_t, PC), next);
+			e.u8(0x80);
+			e.mem(7, reg_off(x));
+			e.u8(nn);
+			jcc = (ir & 0xF000) == 0x3000 ? 0x75 : 0x74;
+			break;
+		// 5XY0/9XY0: mov al, [x]; cmp al, [y]
+		case 0x5000:
+		case 0x9000:
+			e.store16_imm(offsetof(machine_t, PC), next);
+			e.load8(REG_AL, reg_off(x));
+			e.op_rm8(0x3A, REG_AL, reg_off(y));
+			jcc = (ir & 0xF000) == 0x5000 ? 0x75 : 0x74;
+			break;
+		default:
+			return false;
+	}
+
+	e.u8(jcc);
+	e.u8(9);
+	e.store16_imm(offsetof(machine_t, PC), next + 2);
+	return true;
+}
+
+jit_t::jit_t(machine_t& m) : m(m), code(alloc_code()), code_used(0) { discard_all(); }
+
+jit_t::~jit_t()
+{
+	if (code)
+		free_code(code);
+}
+
+bool jit_t::compile(word addr)
+{
+	// 代码缓冲耗尽时整体丢弃
+	if (code_used + MAX_BLOCK_CODE > CODE_SIZE)
+		discard_all();
+
+	emitter_t e{code + code_used};
+
+	word pc = addr;
+	word last_ir = 0;
+	int count = 0;
+	bool exited = false;
+	bool timed = false;
+
+	while (count < MAX_BLOCK_INSTR && pc + 1 < MEM_SIZE)
+	{
+		word ir = (word)((m.ram[pc] << 8) | m.ram[pc + 1]);
+
+		if (emit_body(e, ir))
+		{
+			word op = ir & 0xF0FF;
+			timed |= op == 0xF007 || op == 0xF015 || op == 0xF018;
+			last_ir = ir;
+			pc += 2;
+			count++;
+			continue;
+		}
+
+		// 出口指令需要在修改PC之前写入IR
+		emitter_t probe = e;
+		probe.store16_imm(offsetof(machine_t, IR), ir);
+		if (emit_exit(probe, ir, pc))
+		{
+			e = probe;
+			pc += 2;
+			count++;
+			exited = true;
+		}
+		break;
+	}
+
+	// 首条指令无法翻译时同样记录下来, 直到这里的内存被改写之前不再尝试
+	if (count == 0)
+	{
+		blocks[addr] = {nullptr, (word)(addr + 2), 0, false};
+		valid[addr / 64] |= 1ull << (addr % 64);
+		std::memcpy(source + addr, m.ram + addr, addr + 2 <= MEM_SIZE ? 2 : 1);
+		page_blocks[addr / 256].push_back(addr);
+		return false;
+	}
+
+	if (!exited)
+	{
+		e.store16_imm(offsetof(machine_t, IR), last_ir);
+		e.store16_imm(offsetof(machine_t, PC), pc);
+	}
+	e.ret_count(count);
+
+	blocks[addr].fn = (block_fn)(code + code_used);
+	blocks[addr].end = pc;
+	blocks[addr].len = count;
+	blocks[addr].timed = timed;
+	valid[addr / 64] |= 1ull << (addr % 64);
+	std::memcpy(source + addr, m.ram + addr, pc - addr);
+	code_used = e.p - code;
+
+	for (int page = addr / 256; page <= (pc - 1) / 256; page++)
+		page_blocks[page].push_back(addr);
+
+	return true;
+}
+
+#else
+
+jit_t::jit_t(machine_t& m) : m(m), code(nullptr), code_used(0) { discard_all(); }
+
+jit_t::~jit_t() {}
+
+bool jit_t::compile(word) { return false; }
+
+#endif
+
+void jit_t::invalidate(word addr, int len)
+{
+	int begin = addr & ADDR_MASK;
+	int end = begin + len;
+
+	// 与predecoded_t::invalidate相同, 超出内存的部分回绕到开头
+	invalidate_range(begin, end < MEM_SIZE ? end : MEM_SIZE);
+	if (end > MEM_SIZE)
+		invalidate_range(0, end - MEM_SIZE);
+}
+
+void jit_t::invalidate_range(int begin, int end)
+{
+	for (int page = begin / 256; page <= (end - 1) / 256; page++)
+	{
+		std::vector<word>& list = page_blocks[page];
+		for (size_t i = 0; i < list.size();)
+		{
+			word start = list[i];
+			if (compiled(start) && start < end && blocks[start].end > begin)
+				valid[start / 64] &= ~(1ull << (start % 64));
+
+			// 顺带清理已失效的记录
+			if (!compiled(start))
+			{
+				list[i] = list.back();
+				list.pop_back();
+			}
+			else
+				i++;
+		}
+	}
+}
+
+void jit_t::invalidate_all()
+{
+	// 逐段比较内存与翻译时的内容, 重新装载同一卡带后基本块大多可以继续使用
+	constexpr int CHUNK = 64;
+	for (int begin = 0; begin < MEM_SIZE; begin += CHUNK)
+	{
+		if (!std::memcmp(m.ram + begin, source + begin, CHUNK))
+			continue;
+		invalidate_range(begin, begin + CHUNK);
+		std::memcpy(source + begin, m.ram + begin, CHUNK);
+	}
+}
+
+void jit_t::discard_all()
+{
+	std::memset(valid, 0, sizeof(valid));
+	for (auto& list : page_blocks)
+		list.clear();
+	std::memcpy(source, m.ram, sizeof(source));
+	code_used = 0;
+}
+
+void jit_t::step()
+{
+	word old_i = m.I;
+
+	m.fetch();
+	if (m.profile)
+		m.profile->count(m, m.PC - 2, m.IR);
+	m.execute();
+
+	// FX33/FX55写入内存
+	if ((m.IR & 0xF0FF) == 0xF033)
+		invalidate(old_i, 3);
+	else if ((m.IR & 0xF0FF) == 0xF055)
+		invalidate(old_i, ((m.IR & 0x0F00) >> 8) + 1);
+}
+
+int jit_t::run(int n)
+{
+	int count = 0;
+	while (count < n)
+	{
+		// 空转时直接推进
+		if (int skipped = m.skip_idle(n - count))
+		{
+			count += skipped;
+			continue;
+		}
+
+		// PC的高位超出内存范围时只能解释执行, 以保持与参考实现一致的PC值
+		// 记录轨迹时逐条解释执行, 使每个周期都有记录
+		word addr = m.PC;
+		if (m.state == STATE_RUNNING && !m.trace && addr < MEM_SIZE &&
+			(compiled(addr) ? blocks[addr].fn != nullptr : compile(addr)))
+		{
+			// 不涉及计时器的基本块可以跨越计时器递减, 由advance在执行后补上
+			const block_t& b = blocks[addr];
+			if (b.len <= n - count && (!b.timed || (uint64_t)b.len <= m.next_tick - m.cycles))
+			{
+				if (m.profile)
+					m.profile->count_block(m, addr, b.len);
+				b.fn(&m);
+				count += b.len;
+				m.advance(b.len);
+				continue;
+			}
+		}
+
+		if (m.state == STATE_RUNNING)
+			step();
+		// 等待按键或垂直消隐时交给参考实现处理
+		else if (m.waiting())
+		{
+			if (m.profile && m.state == STATE_WAIT_KEY)
+				m.profile->count_wait();
+			m.execute();
+		}
+		else
+			break;
+
+		count++;
+		m.advance(1);
+
+		if (m.trace)
+			m.trace->record(m);
+
+		if (m.halted())
+			break;
+	}
+	return count;
+}
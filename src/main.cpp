@@ -1,14 +1,19 @@
+#include "audio.h"
 #include "common.h"
+#include "spsc.h"
 
 #include <SDL3/SDL.h>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <winerror.h>
-#include <winscard.h>
+#include <mutex>
+#include <thread>
 
 // 由一个粗糙实现的sdl后端提供支持
 // 通过修改common.h中的FILE_PATH来决定运行哪个卡带
@@ -29,33 +34,20 @@ constexpr int KeyMap[KeyNum]{
 constexpr int SCREEN_WIDTH = 64;
 constexpr int SCREEN_HEIGHT = 32;
 
+// 只由模拟线程访问, 渲染线程的按键经input_queue传入
 key_state_t keys_state[KeyNum]{};
 
-SDL_Surface* bg;
-SDL_Surface* vram;
+SDL_Renderer* renderer;
 
-SDL_Surface* screen;
+// 64x32的流式纹理, 每次重绘整体上传一次, 缩放交给gpu
+SDL_Texture* texture;
 
 bool screen_changed = true;
 
-void clear_screen() { screen_changed = true; }; // { SDL_ClearSurface(vram, 0, 0, 0, 0); }
-void screen_pixel(uint x, uint y, bool f)
+void screen_present(const uint32_t* pixels)
 {
-	constexpr uint8_t FG = 20;
-
-	uint8_t c;
-	SDL_ReadSurfacePixel(vram, x, y, &c, nullptr, nullptr, nullptr);
-
-	if (c > 0 && !f)
-	{
-		c = std::min((int)c + 40, 255);
-	}
-	else
-	{
-		c = f ? FG : 255;
-	}
-
-	SDL_WriteSurfacePixel(vram, x, y, c, c, c, 255 - c);
+	SDL_UpdateTexture(texture, nullptr, pixels, SCREEN_WIDTH * sizeof(uint32_t));
+	screen_changed = true;
 }
 
 key_state_t get_key(byte key_id)
@@ -85,34 +77,18 @@ bool any_key(key_state_t state, byte* key_id)
 	return false;
 }
 
-void init_surface(SDL_Window* window)
+void init_texture()
 {
-	screen = SDL_GetWindowSurface(window);
-	bg = SDL_CreateSurface(SCREEN_WIDTH, SCREEN_HEIGHT, SDL_PIXELFORMAT_RGBA32);
-	vram = SDL_CreateSurface(SCREEN_WIDTH, SCREEN_HEIGHT, SDL_PIXELFORMAT_RGBA32);
-
-	constexpr uint8_t BG0 = 135;
-	constexpr uint8_t BG1 = 150;
-
-	bool f = true;
-	for (int y = 0; y < SCREEN_HEIGHT; y++)
-	{
-		for (int x = 0; x < SCREEN_WIDTH; x++)
-		{
-			f = !f;
-			uint8_t a = f ? BG0 : BG1;
-
-			SDL_WriteSurfacePixel(bg, x, y, a, a, a, 255);
-		}
-		f = !f;
-	}
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+	SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
 }
 
 void draw(float scale, uint32_t ox, uint32_t oy)
 {
-	SDL_Rect dst{(int)ox, (int)oy, (int)(vram->w * scale), (int)(vram->h * scale)};
-	SDL_BlitSurfaceScaled(bg, nullptr, screen, &dst, SDL_SCALEMODE_NEAREST);
-	SDL_BlitSurfaceScaled(vram, nullptr, screen, &dst, SDL_SCALEMODE_NEAREST);
+	SDL_FRect dst{(float)ox, (float)oy, SCREEN_WIDTH * scale, SCREEN_HEIGHT * scale};
+	SDL_RenderClear(renderer);
+	SDL_RenderTexture(renderer, texture, nullptr, &dst);
+	SDL_RenderPresent(renderer);
 }
 
 void update_display(int fps, float instr_duration, const char* state_str)
@@ -129,86 +105,325 @@ void update_display(int fps, float instr_duration, const char* state_str)
 	std::fflush(stdout);
 }
 
-int main()
+void print_usage(const char* exe)
 {
-	SDL_Window* window = nullptr;
-	SDL_Renderer* renderer = nullptr;
-	SDL_CreateWindowAndRenderer("other chip8 simulator", 800, 600, 0, &window, &renderer);
+	std::printf("usage: %s [rom] [--ips N] [--speed X] [--turbo] [--vblank] [--seed N] [--record FILE] [--play FILE] "
+				"[--trace FILE]\n"
+				"  --ips N    execute N instructions per emulated second (default 700)\n"
+				"  --speed X  run X emulated frames per host frame\n"
+				"  --turbo    run as many emulated frames as fit in each host frame\n"
+				"  --vblank   wait for vertical blank after each sprite draw, like the COSMAC VIP\n"
+				"  --seed N   seed the random number generator used by CXNN\n"
+				"  --record FILE  record key input to a movie file, written on exit\n"
+				"  --play FILE    replay a movie with its recorded settings, live keys are ignored until it ends\n"
+				"  --trace FILE  record a binary execution trace, decode it with chip9-trace\n"
+				"keys: F5 save state, F9 load state, hold Backspace to rewind\n",
+		exe);
+}
 
-	init_surface(window);
+// 渲染线程交给模拟线程的输入
+struct input_event_t
+{
+	enum kind_t : byte
+	{
+		KEY_DOWN,
+		KEY_UP,
+		SAVE_STATE,
+		LOAD_STATE,
+		REWIND_BEGIN,
+		REWIND_END,
+	};
+
+	kind_t kind;
+	byte key;
+};
 
-	static char file_name_rev[32]{};
-	std::scanf("%30s", file_name_rev);
-	
-	start(file_name_rev);
+static chip8::spsc_queue_t<input_event_t, 256> input_queue;
 
-	// 以每秒700个指令的速度执行
-	constexpr uint64_t FrameIntervalNs = 1000000 / 700;
+// 模拟线程在帧之间与等待输入时在此休眠, 有新的输入或退出时唤醒
+static std::mutex wake_lock;
+static std::condition_variable wake_cv;
+static std::atomic<bool> quit{false};
 
-	bool quit = false;
+// 模拟线程发布新的画面后发给渲染线程的事件
+static Uint32 frame_event = 0;
 
-	uint64_t frame_delay = 0;
-	uint64_t instr_duration = 0;
+static void post_input(input_event_t::kind_t kind, byte key = 0)
+{
+	// 队列满时等待模拟线程取走
+	while (!input_queue.push({kind, key}))
+		std::this_thread::yield();
+
+	// 加锁使通知不会落在模拟线程检查队列与开始休眠之间
+	{
+		std::lock_guard<std::mutex> lk(wake_lock);
+	}
+	wake_cv.notify_one();
+}
+
+static void stop_emulation()
+{
+	{
+		std::lock_guard<std::mutex> lk(wake_lock);
+		quit = true;
+	}
+	wake_cv.notify_one();
+}
+
+// 取出渲染线程传来的输入, 返回是否处于倒带中
+static bool drain_input(bool rewinding)
+{
+	// 清除按键状态
+	for (int i = 0; i < KeyNum; i++)
+	{
+		auto& code = keys_state[i];
+		if (code == key_state_t::RELEASE)
+			code = key_state_t::NONE;
+	}
+
+	input_event_t e;
+	while (input_queue.pop(&e))
+	{
+		switch (e.kind)
+		{
+			case input_event_t::KEY_DOWN:
+				keys_state[e.key] = key_state_t::PRESSED;
+				break;
+			case input_event_t::KEY_UP:
+				keys_state[e.key] = key_state_t::RELEASE;
+				break;
+			case input_event_t::SAVE_STATE:
+				save_state();
+				break;
+			case input_event_t::LOAD_STATE:
+				load_state();
+				break;
+			case input_event_t::REWIND_BEGIN:
+				rewinding = true;
+				break;
+			case input_event_t::REWIND_END:
+				rewinding = false;
+				break;
+		}
+	}
+	return rewinding;
+}
+
+// 模拟线程, 以60hz执行虚拟帧, 不受窗口拖动与重绘耗时的影响
+static void emulation_loop(double speed, bool turbo)
+{
+	// 以60hz执行虚拟帧, 每帧的指令数由机器的时钟决定
+	constexpr uint64_t FrameIntervalNs = 1000000000 / 60;
+
+	// 加速时留给执行虚拟帧的时间, 剩余的用于处理输入与等待
+	constexpr uint64_t TurboBudgetNs = FrameIntervalNs * 3 / 4;
+
+	// 落后超过这么多帧时不再追赶
+	constexpr uint64_t MaxLagNs = FrameIntervalNs * 4;
+
+	// 尚未执行的虚拟帧, 用于非整数的倍率
+	double pending_frames = 0;
+
+	// 按住退格键时倒带
+	bool rewinding = false;
+
+	// 按固定的时间点推进, 单帧的波动不会累积
+	uint64_t next_frame = uptime_ns();
 
-	SDL_Event event{};
 	while (!quit)
 	{
 		auto start_time = uptime_ns();
 
-		// 绘制调试信息
-		// int fps = (int)(1000000000.0f / frame_delay);
-		// update_display(fps, instr_duration, state_str());
+		rewinding = drain_input(rewinding);
 
-		// 清除按键状态
-		for (int i = 0; i < KeyNum; i++)
+		if (rewinding)
+			rewind_frames(1);
+		else if (turbo)
 		{
-			auto& code = keys_state[i];
-			if (code == key_state_t::RELEASE)
-				code = key_state_t::NONE;
+			while (update() && uptime_ns() - start_time < TurboBudgetNs)
+				;
 		}
-
-		while (SDL_PollEvent(&event) != 0)
+		else
 		{
-			if (event.type == SDL_EVENT_QUIT)
-				quit = true;
-			else if (event.type == SDL_EVENT_KEY_UP)
-			{
-				const int* end = KeyMap + KeyNum;
-				auto it = std::find(KeyMap, end, event.key.key);
-				if (it != end)
-				{
-					byte key_code = it - KeyMap;
-					// std::printf("key trigger: %X\n", key_code);
-					keys_state[key_code] = key_state_t::RELEASE;
-				}
-			}
-			else if (event.type == SDL_EVENT_KEY_DOWN)
+			pending_frames += speed;
+			while (pending_frames >= 1.0)
 			{
-				const int* end = KeyMap + KeyNum;
-				auto it = std::find(KeyMap, end, event.key.key);
-				if (it != end)
-				{
-					byte key_code = it - KeyMap;
-					// std::printf("key trigger: %X\n", key_code);
-					keys_state[key_code] = key_state_t::PRESSED;
-				}
+				update();
+				pending_frames -= 1.0;
 			}
 		}
 
+		// 唤醒渲染线程取走新的画面
+		if (frame_event)
 		{
-			uint64_t _st = uptime_ns();
-			update();
-			instr_duration = uptime_ns() - _st;
+			SDL_Event event{};
+			event.type = frame_event;
+			SDL_PushEvent(&event);
 		}
 
+		std::unique_lock<std::mutex> lk(wake_lock);
+		if (!rewinding && waiting_input())
+		{
+			// 机器在按键变化之前不会有任何变化, 休眠到有新的输入, 期间不推进虚拟时间
+			wake_cv.wait(lk, [] { return quit || !input_queue.empty(); });
+			next_frame = uptime_ns();
+			continue;
+		}
+
+		next_frame += FrameIntervalNs;
+		uint64_t now = uptime_ns();
+		if (now > next_frame + MaxLagNs)
+			next_frame = now;
+		else if (next_frame > now)
+			wake_cv.wait_for(lk, std::chrono::nanoseconds(next_frame - now), [] { return quit.load(); });
+	}
+}
+
+// 将sdl按键转换为chip8键码, 不是chip8按键时返回false
+static bool map_key(SDL_Keycode key, byte* key_code)
+{
+	const int* end = KeyMap + KeyNum;
+	auto it = std::find(KeyMap, end, key);
+	if (it == end)
+		return false;
+
+	*key_code = (byte)(it - KeyMap);
+	return true;
+}
+
+static void handle_event(const SDL_Event& event)
+{
+	byte key_code;
+	if (event.type == SDL_EVENT_QUIT)
+		stop_emulation();
+	else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_F5)
+		post_input(input_event_t::SAVE_STATE);
+	else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_F9)
+		post_input(input_event_t::LOAD_STATE);
+	else if ((event.type == SDL_EVENT_KEY_DOWN || event.type == SDL_EVENT_KEY_UP) && event.key.key == SDLK_BACKSPACE)
+	{
+		// 按住时的重复事件不需要传递
+		if (!event.key.repeat)
+			post_input(event.type == SDL_EVENT_KEY_DOWN ? input_event_t::REWIND_BEGIN : input_event_t::REWIND_END);
+	}
+	else if (event.type == SDL_EVENT_KEY_UP && map_key(event.key.key, &key_code))
+	{
+		// std::printf("key trigger: %X\n", key_code);
+		post_input(input_event_t::KEY_UP, key_code);
+	}
+	else if (event.type == SDL_EVENT_KEY_DOWN && !event.key.repeat && map_key(event.key.key, &key_code))
+	{
+		// std::printf("key trigger: %X\n", key_code);
+		post_input(input_event_t::KEY_DOWN, key_code);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char* rom_path = nullptr;
+	uint32_t ips = 0;
+	double speed = 1.0;
+	bool turbo = false;
+	bool vblank = false;
+	uint32_t seed = 0;
+	const char* record_path = nullptr;
+	const char* play_path = nullptr;
+	const char* trace_path = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!std::strcmp(argv[i], "--ips") && i + 1 < argc)
+			ips = (uint32_t)std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--speed") && i + 1 < argc)
+			speed = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--turbo"))
+			turbo = true;
+		else if (!std::strcmp(argv[i], "--vblank"))
+			vblank = true;
+		else if (!std::strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = (uint32_t)std::strtoul(argv[++i], nullptr, 0);
+		else if (!std::strcmp(argv[i], "--record") && i + 1 < argc)
+			record_path = argv[++i];
+		else if (!std::strcmp(argv[i], "--play") && i + 1 < argc)
+			play_path = argv[++i];
+		else if (!std::strcmp(argv[i], "--trace") && i + 1 < argc)
+			trace_path = argv[++i];
+		else if (argv[i][0] != '-' && !rom_path)
+			rom_path = argv[i];
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (speed <= 0)
+		speed = 1.0;
+
+	SDL_Window* window = nullptr;
+	SDL_CreateWindowAndRenderer("other chip8 simulator", 800, 600, 0, &window, &renderer);
+
+	// 重绘等待垂直同步, 不支持时立即提交
+	SDL_SetRenderVSync(renderer, 1);
+
+	init_texture();
+
+	// 打开失败时静音运行
+	audio_open(chip8::DEFAULT_SAMPLE_RATE);
+
+	frame_event = SDL_RegisterEvents(1);
+
+	static char file_name_rev[32]{};
+	if (!rom_path)
+	{
+		std::scanf("%30s", file_name_rev);
+		rom_path = file_name_rev;
+	}
+
+	start(rom_path);
+	if (ips)
+		set_clock(ips);
+	set_vblank_wait(vblank);
+	set_seed(seed);
+	if (play_path && !play_movie(play_path))
+		return 1;
+	if (record_path && !record_movie(record_path))
+		return 1;
+	if (trace_path && !set_trace(trace_path))
+		return 1;
+
+	// 此后机器只由模拟线程驱动
+	std::thread emulation(emulation_loop, speed, turbo);
+
+	// 渲染线程: 处理事件并在有新的画面或淡出未结束时重绘
+	constexpr int RefreshIntervalMs = 1000 / 60;
+
+	SDL_Event event{};
+	while (!quit)
+	{
+		// 输入立即交给模拟线程, 没有事件时至多等待一个刷新周期以继续淡出
+		if (SDL_WaitEventTimeout(&event, RefreshIntervalMs))
+		{
+			do
+				handle_event(event);
+			while (SDL_PollEvent(&event));
+		}
+
+		present();
+
 		if (screen_changed)
 		{
 			draw(10, 100, 100);
-			SDL_UpdateWindowSurface(window);
 			screen_changed = false;
 		}
-
-		SDL_Delay(2);
 	}
+
+	emulation.join();
+	audio_close();
+
+	// 写出录制的录像
+	stop_movie();
+
+	// 写出剩余的轨迹
+	set_trace(nullptr);
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,195 @@
+#include "movie.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace chip8;
+
+uint64_t chip8::hash_program(const machine_t& m)
+{
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (int i = PROG_MEM_OFFSET; i < MEM_SIZE; i++)
+	{
+		h ^= m.ram[i];
+		h *= 0x100000001B3ull;
+	}
+	return h;
+}
+
+movie_t::movie_t() : rom_hash(0), seed(DEFAULT_RNG_SEED), ips(DEFAULT_IPS), quirks(0), length(0) {}
+
+bool movie_t::begin(const machine_t& m)
+{
+	if (m.cycles)
+	{
+		std::printf("Error: Movie recording must start right after reset\n");
+		return false;
+	}
+
+	rom_hash = hash_program(m);
+	seed = m.rng;
+	ips = m.ips;
+	quirks = m.quirks;
+	length = 0;
+	events.clear();
+	return true;
+}
+
+void movie_t::record(uint64_t cycle, int key, bool pressed)
+{
+	events.push_back({cycle, (byte)key, pressed});
+	length = cycle;
+}
+
+void movie_t::truncate(uint64_t cycle)
+{
+	events.resize(seek(cycle));
+	length = cycle;
+}
+
+bool movie_t::apply(machine_t& m) const
+{
+	if (m.cycles || hash_program(m) != rom_hash)
+	{
+		std::printf("Error: Movie was recorded with a different rom\n");
+		return false;
+	}
+
+	m.set_clock(ips);
+	m.set_quirks(quirks);
+	m.seed_rng(seed);
+	return true;
+}
+
+size_t movie_t::seek(uint64_t cycle) const
+{
+	size_t lo = 0, hi = events.size();
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (events[mid].cycle < cycle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// 小端写入
+static void put_le(FILE* f, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		std::fputc((int)((v >> (i * 8)) & 0xFF), f);
+}
+
+static bool get_le(FILE* f, uint64_t* v, int bytes)
+{
+	*v = 0;
+	for (int i = 0; i < bytes; i++)
+	{
+		int c = std::fgetc(f);
+		if (c == EOF)
+			return false;
+		*v |= (uint64_t)c << (i * 8);
+	}
+	return true;
+}
+
+static void put_varint(FILE* f, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		std::fputc((int)(v & 0x7F) | 0x80, f);
+		v >>= 7;
+	}
+	std::fputc((int)v, f);
+}
+
+static bool get_varint(FILE* f, uint64_t* v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int c = std::fgetc(f);
+		if (c == EOF)
+			return false;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool movie_t::save(const char* path) const
+{
+	FILE* f = std::fopen(path, "wb");
+	if (!f)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	std::fwrite(MOVIE_MAGIC, 1, sizeof(MOVIE_MAGIC), f);
+	put_le(f, MOVIE_VERSION, 2);
+	put_le(f, rom_hash, 8);
+	put_le(f, seed, 4);
+	put_le(f, ips, 4);
+	put_le(f, quirks, 4);
+	put_le(f, length, 8);
+	put_le(f, events.size(), 4);
+
+	uint64_t last = 0;
+	for (const movie_event_t& e : events)
+	{
+		put_varint(f, (e.cycle - last) << 5 | (uint64_t)e.pressed << 4 | e.key);
+		last = e.cycle;
+	}
+
+	bool ok = !std::ferror(f);
+	if (std::fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		std::printf("Error: Could not write %s\n", path);
+	return ok;
+}
+
+bool movie_t::load(const char* path)
+{
+	FILE* f = std::fopen(path, "rb");
+	if (!f)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	char magic[4];
+	uint64_t version, hash, s, clock, q, len, count;
+	bool ok = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !std::memcmp(magic, MOVIE_MAGIC, 4) &&
+			  get_le(f, &version, 2) && version == MOVIE_VERSION && get_le(f, &hash, 8) && get_le(f, &s, 4) &&
+			  get_le(f, &clock, 4) && get_le(f, &q, 4) && get_le(f, &len, 8) && get_le(f, &count, 4);
+
+	std::vector<movie_event_t> list;
+	uint64_t cycle = 0;
+	for (uint64_t i = 0; ok && i < count; i++)
+	{
+		uint64_t v;
+		ok = get_varint(f, &v);
+		cycle += v >> 5;
+		list.push_back({cycle, (byte)(v & 0xF), (v & 0x10) != 0});
+	}
+	std::fclose(f);
+
+	if (!ok || cycle > len)
+	{
+		std::printf("Error: %s is not a valid movie\n", path);
+		return false;
+	}
+
+	rom_hash = hash;
+	seed = (uint32_t)s;
+	ips = (uint32_t)clock;
+	quirks = (uint32_t)q;
+	length = len;
+	events.swap(list);
+	return true;
+}
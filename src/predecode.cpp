@@ -0,0 +1,561 @@
+// 预解码解释器
+// 指令语义与machine_t::execute保持一致, 后者作为参考实现
+#include "predecode.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace chip8;
+
+constexpr word ADDR_MASK = MEM_SIZE - 1;
+
+// 00E0: 清屏
+static word op_cls(predecoded_t& e, const op_t&, word pc)
+{
+	machine_t& m = e.machine();
+	m.clear_vram();
+	return pc;
+}
+
+// 00EE: 弹出栈顶地址
+static word op_ret(predecoded_t& e, const op_t&, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.SP == 0)
+	{
+		m.state = STATE_ERROR_POP_EMPTY_STAKC;
+		return pc;
+	}
+	m.SP--;
+	return m.stack[m.SP];
+}
+
+// 1NNN: 无条件跳转到NNN
+static word op_jp(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+
+	// 额外处理死循环
+	if (op.nnn == pc - 2)
+	{
+		m.state = STATE_INFINITE_LOOP;
+		return pc;
+	}
+	return op.nnn;
+}
+
+// 2NNN: 将当前地址压栈并跳转到NNN
+static word op_call(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.SP >= STACK_DEEP)
+	{
+		m.state = STATE_ERROR_STAKE_FULL;
+		return pc;
+	}
+	m.stack[m.SP++] = pc;
+	return op.nnn;
+}
+
+// 3XNN: 若Vx==NN, 则跳过下一条指令
+static word op_se_imm(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.reg[op.x] == op.nn)
+		return pc + 2;
+	return pc;
+}
+
+// 4XNN: 若Vx!=NN, 则跳过下一条指令
+static word op_sne_imm(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.reg[op.x] != op.nn)
+		return pc + 2;
+	return pc;
+}
+
+// 5XY0: 若Vx==Vy, 则跳过下一条指令
+static word op_se_reg(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.reg[op.x] == m.reg[op.y])
+		return pc + 2;
+	return pc;
+}
+
+// 6XNN: Vx=NN
+static word op_ld_imm(predecoded_t& e, const op_t& op, word pc)
+{
+	e.machine().reg[op.x] = op.nn;
+	return pc;
+}
+
+// 7XNN: Vx+=NN, 不设置进位标志
+static word op_add_imm(predecoded_t& e, const op_t& op, word pc)
+{
+	e.machine().reg[op.x] += op.nn;
+	return pc;
+}
+
+// 8XY0: Vx = Vy
+static word op_mov(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.reg[op.x] = m.reg[op.y];
+	return pc;
+}
+
+// 8XY1: Vx |= Vy
+static word op_or(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.reg[op.x] |= m.reg[op.y];
+	m.reg[0xF] = 0;
+	return pc;
+}
+
+// 8XY2: Vx &= Vy
+static word op_and(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.reg[op.x] &= m.reg[op.y];
+	m.reg[0xF] = 0;
+	return pc;
+}
+
+// 8XY3: Vx ^= Vy
+static word op_xor(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.reg[op.x] ^= m.reg[op.y];
+	m.reg[0xF] = 0;
+	return pc;
+}
+
+// 8XY4: Vx += Vy
+static word op_add(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	int v = m.reg[op.x] + m.reg[op.y];
+	m.reg[op.x] = (byte)v;
+	m.reg[0xF] = v > 0xFF;
+	return pc;
+}
+
+// 8XY5: Vx -= Vy
+static word op_sub(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	byte x = m.reg[op.x], y = m.reg[op.y];
+	m.reg[op.x] = x - y;
+	m.reg[0xF] = x >= y;
+	return pc;
+}
+
+// 8XY6: Vx >>= 1
+static word op_shr(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	byte x = m.reg[op.x];
+	m.reg[op.x] = x >> 1;
+	m.reg[0xF] = x & 1;
+	return pc;
+}
+
+// 8XY7: Vx = Vy - Vx
+static word op_subn(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	byte x = m.reg[op.x], y = m.reg[op.y];
+	m.reg[op.x] = y - x;
+	m.reg[0xF] = y >= x;
+	return pc;
+}
+
+// 8XYE: Vx <<= 1
+static word op_shl(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	byte x = m.reg[op.x];
+	m.reg[op.x] = x << 1;
+	m.reg[0xF] = (x & 0x80) > 0;
+	return pc;
+}
+
+// 9XY0: 若Vx!=Vy, 则跳过下一条指令
+static word op_sne_reg(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.reg[op.x] != m.reg[op.y])
+		return pc + 2;
+	return pc;
+}
+
+// ANNN: I=NNN
+static word op_ld_i(predecoded_t& e, const op_t& op, word pc)
+{
+	e.machine().I = op.nnn;
+	return pc;
+}
+
+// BNNN: 跳转到地址V0+NNN
+static word op_jp_v0(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	return pc + m.reg[0] + op.nnn;
+}
+
+// CXNN: Vx=rand() & NN
+static word op_rnd(predecoded_t& e, const op_t& op, word pc)
+{
+	e.machine().reg[op.x] = op.nn & e.machine().random();
+	return pc;
+}
+
+// DXYN: 绘制精灵
+static word op_drw(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+
+	word addr = m.I & ADDR_MASK;
+	int h = op.n;
+	if (addr + h > MEM_SIZE)
+		h = MEM_SIZE - addr;
+
+	m.draw(m.reg[op.x], m.reg[op.y], m.ram + addr, h);
+	if (m.quirks & QUIRK_VBLANK_WAIT)
+		m.state = STATE_WAIT_VBLANK;
+	return pc;
+}
+
+// EX9E: if (keys(Vx)) PC+=2
+static word op_skp(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (m.keys & (1 << (m.reg[op.x] & 0xF)))
+		return pc + 2;
+	return pc;
+}
+
+// EXA1: if (!keys(Vx)) PC+=2
+static word op_sknp(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	if (!(m.keys & (1 << (m.reg[op.x] & 0xF))))
+		return pc + 2;
+	return pc;
+}
+
+// FX07: Vx = delay_timer
+static word op_ld_vx_dt(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.reg[op.x] = m.dt;
+	return pc;
+}
+
+// FX0A: 阻塞的等待按键按下并储存到Vx
+static word op_ld_vx_k(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.state = STATE_WAIT_KEY;
+	m.cached_reg = op.x;
+	m.keys_released = 0;
+	return pc;
+}
+
+// FX15: delay_timer=Vx
+static word op_ld_dt(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.dt = m.reg[op.x];
+	return pc;
+}
+
+// FX18: sound_timer=Vx
+static word op_ld_st(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.st = m.reg[op.x];
+	return pc;
+}
+
+// FX1E: I+=Vx
+static word op_add_i(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.I += m.reg[op.x];
+	return pc;
+}
+
+// FX29: 将I设置为Vx所储存的字符精灵的地址
+static word op_ld_f(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	m.I = m.font_mem_offset + (m.reg[op.x] & 0xF) * 4;
+	return pc;
+}
+
+// FX33: 拆解Vx的百,十,个位, 分别储存到I,I+1,I+2
+static word op_ld_b(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	byte val = m.reg[op.x];
+
+	m.ram[m.I & ADDR_MASK] = (val / 100) % 10;
+	m.ram[(m.I + 1) & ADDR_MASK] = (val / 10) % 10;
+	m.ram[(m.I + 2) & ADDR_MASK] = val % 10;
+
+	e.invalidate(m.I, 3);
+	return pc;
+}
+
+// FX55: 将V0-Vx储存到I-I+x
+static word op_ld_i_vx(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	for (int i = 0; i <= op.x; i++)
+		m.ram[(m.I + i) & ADDR_MASK] = m.reg[i];
+
+	e.invalidate(m.I, op.x + 1);
+
+	// 没有记录的原始实现定义行为
+	m.I += op.x;
+	return pc;
+}
+
+// FX65: 从I-I+x读取值并储存到V0-Vx
+static word op_ld_vx_i(predecoded_t& e, const op_t& op, word pc)
+{
+	machine_t& m = e.machine();
+	for (int i = 0; i <= op.x; i++)
+		m.reg[i] = m.ram[(m.I + i) & ADDR_MASK];
+
+	// 没有记录的原始实现定义行为
+	m.I += op.x;
+	return pc;
+}
+
+// 未实现或无效的指令
+static word op_invalid(predecoded_t& e, const op_t&, word pc)
+{
+	e.machine().state = STATE_NOT_IMPL;
+	return pc;
+}
+
+// 选择指令对应的处理函数
+static op_handler_t select_handler(word ir)
+{
+	switch (ir & 0xF000)
+	{
+		case 0x0000:
+			if (ir == 0x00E0)
+				return op_cls;
+			if (ir == 0x00EE)
+				return op_ret;
+			return op_invalid;
+		case 0x1000:
+			return op_jp;
+		case 0x2000:
+			return op_call;
+		case 0x3000:
+			return op_se_imm;
+		case 0x4000:
+			return op_sne_imm;
+		case 0x5000:
+			return op_se_reg;
+		case 0x6000:
+			return op_ld_imm;
+		case 0x7000:
+			return op_add_imm;
+		case 0x8000:
+			switch (ir & 0x000F)
+			{
+				case 0:
+					return op_mov;
+				case 1:
+					return op_or;
+				case 2:
+					return op_and;
+				case 3:
+					return op_xor;
+				case 4:
+					return op_add;
+				case 5:
+					return op_sub;
+				case 6:
+					return op_shr;
+				case 7:
+					return op_subn;
+				case 0xE:
+					return op_shl;
+				default:
+					return op_invalid;
+			}
+		case 0x9000:
+			return op_sne_reg;
+		case 0xA000:
+			return op_ld_i;
+		case 0xB000:
+			return op_jp_v0;
+		case 0xC000:
+			return op_rnd;
+		case 0xD000:
+			return op_drw;
+		case 0xE000:
+			switch (ir & 0xF0FF)
+			{
+				case 0xE09E:
+					return op_skp;
+				case 0xE0A1:
+					return op_sknp;
+				default:
+					return op_invalid;
+			}
+		default:
+			switch (ir & 0xF0FF)
+			{
+				case 0xF007:
+					return op_ld_vx_dt;
+				case 0xF00A:
+					return op_ld_vx_k;
+				case 0xF015:
+					return op_ld_dt;
+				case 0xF018:
+					return op_ld_st;
+				case 0xF01E:
+					return op_add_i;
+				case 0xF029:
+					return op_ld_f;
+				case 0xF033:
+					return op_ld_b;
+				case 0xF055:
+					return op_ld_i_vx;
+				case 0xF065:
+					return op_ld_vx_i;
+				default:
+					return op_invalid;
+			}
+	}
+}
+
+predecoded_t::predecoded_t(machine_t& m) : m(m) { invalidate_all(); }
+
+const op_t& predecoded_t::decode(word addr)
+{
+	op_t& op = ops[addr];
+
+	word ir = (word)((m.ram[addr] << 8) | m.ram[(addr + 1) & ADDR_MASK]);
+	op.raw = ir;
+	op.nnn = ir & 0x0FFF;
+	op.x = (ir & 0x0F00) >> 8;
+	op.y = (ir & 0x00F0) >> 4;
+	op.n = ir & 0x000F;
+	op.nn = ir & 0x00FF;
+	op.fn = select_handler(ir);
+
+	return op;
+}
+
+void predecoded_t::invalidate(word addr, int len)
+{
+	// 起始于addr-1的指令同样覆盖了addr
+	for (int i = -1; i < len; i++)
+		ops[(addr + i) & ADDR_MASK].fn = nullptr;
+}
+
+void predecoded_t::invalidate_all()
+{
+	for (int i = 0; i < MEM_SIZE; i++)
+		ops[i].fn = nullptr;
+}
+
+int predecoded_t::run_block(int n)
+{
+	word pc = m.PC;
+	word ir;
+	int count = 0;
+	do
+	{
+		word addr = pc & ADDR_MASK;
+
+		const op_t* op = &ops[addr];
+		if (!op->fn)
+			op = &decode(addr);
+
+		ir = op->raw;
+		pc = op->fn(*this, *op, pc + 2);
+		count++;
+	} while (count < n && m.state == STATE_RUNNING && ((ir >> 12) != 0x1 || m.idle_miss_tick == m.ticks));
+
+	m.PC = pc;
+	m.IR = ir;
+	return count;
+}
+
+int predecoded_t::run(int n)
+{
+	int count = 0;
+	while (count < n)
+	{
+		// 空转时直接推进
+		if (int skipped = m.skip_idle(n - count))
+		{
+			count += skipped;
+			continue;
+		}
+
+		// 不记录时连续执行到下一次计时器递减, 最后统一推进周期
+		if (m.state == STATE_RUNNING && !m.profile && !m.trace)
+		{
+			uint64_t left = (uint64_t)(n - count);
+			if (m.next_tick - m.cycles < left)
+				left = m.next_tick - m.cycles;
+
+			int k = run_block((int)left);
+			count += k;
+			m.advance(k);
+
+			if (m.halted())
+				break;
+			continue;
+		}
+
+		if (m.state == STATE_RUNNING)
+		{
+			word addr = m.PC & ADDR_MASK;
+
+			const op_t* op = &ops[addr];
+			if (!op->fn)
+				op = &decode(addr);
+
+			m.IR = op->raw;
+			m.PC += 2;
+			if (m.profile)
+				m.profile->count(m, addr, op->raw);
+			m.PC = op->fn(*this, *op, m.PC);
+		}
+		// 等待按键或垂直消隐时交给参考实现处理
+		else if (m.waiting())
+		{
+			if (m.profile && m.state == STATE_WAIT_KEY)
+				m.profile->count_wait();
+			m.execute();
+		}
+		else
+			break;
+
+		count++;
+		m.advance(1);
+
+		if (m.trace)
+			m.trace->record(m);
+
+		if (m.halted())
+			break;
+	}
+	return count;
+}
@@ -0,0 +1,97 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+using namespace chip8;
+
+// 按最高4位划分的指令类别
+static const char* OP_CLASS_NAMES[16] = {
+	"0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+	"8XYN", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EXNN", "FXNN",
+};
+
+void profile_t::clear(uint32_t period)
+{
+	std::memset(pc_hits, 0, sizeof(pc_hits));
+	std::memset(op_hits, 0, sizeof(op_hits));
+	wait_key_cycles = 0;
+	stacks.clear();
+	sample_period = period ? period : DEFAULT_SAMPLE_PERIOD;
+	sample_left = sample_period;
+}
+
+void profile_t::count_block(const machine_t& m, word addr, int len)
+{
+	for (int i = 0; i < len; i++)
+	{
+		word a = (addr + i * 2) & (MEM_SIZE - 1);
+		word ir = (word)((m.ram[a] << 8) | m.ram[(a + 1) & (MEM_SIZE - 1)]);
+		count(m, a, ir);
+	}
+}
+
+void profile_t::sample(const machine_t& m, word addr)
+{
+	sample_left = sample_period;
+
+	// 栈中保存的是返回地址, 减2得到调用点
+	std::vector<word> key;
+	int depth = m.SP < STACK_DEEP ? m.SP : STACK_DEEP;
+	key.reserve(depth + 1);
+	for (int i = 0; i < depth; i++)
+		key.push_back((word)((m.stack[i] - 2) & (MEM_SIZE - 1)));
+	key.push_back(addr & (MEM_SIZE - 1));
+
+	stacks[key]++;
+}
+
+void profile_t::dump_flat(FILE* f, const machine_t& m, int top) const
+{
+	uint64_t total = 0;
+	for (uint64_t n : op_hits)
+		total += n;
+	double scale = total ? 100.0 / total : 0;
+
+	std::fprintf(f, "instructions: %" PRIu64 "\n", total);
+	std::fprintf(f, "wait key cycles: %" PRIu64 "\n", wait_key_cycles);
+	std::fprintf(f, "draws: %" PRIu64 "\n\n", draws());
+
+	std::fprintf(f, "class        count      %%\n");
+	for (int i = 0; i < 16; i++)
+	{
+		if (op_hits[i])
+			std::fprintf(f, "%s  %12" PRIu64 "  %5.2f\n", OP_CLASS_NAMES[i], op_hits[i], op_hits[i] * scale);
+	}
+
+	std::vector<word> addrs;
+	for (int a = 0; a < MEM_SIZE; a++)
+	{
+		if (pc_hits[a])
+			addrs.push_back((word)a);
+	}
+	std::sort(addrs.begin(), addrs.end(), [this](word a, word b) {
+		return pc_hits[a] != pc_hits[b] ? pc_hits[a] > pc_hits[b] : a < b;
+	});
+	if ((int)addrs.size() > top)
+		addrs.resize(top);
+
+	std::fprintf(f, "\naddr  op           count      %%\n");
+	for (word a : addrs)
+	{
+		word ir = (word)((m.ram[a] << 8) | m.ram[(a + 1) & (MEM_SIZE - 1)]);
+		std::fprintf(f, "%03X   %04X  %12" PRIu64 "  %5.2f\n", a, ir, pc_hits[a], pc_hits[a] * scale);
+	}
+}
+
+void profile_t::dump_collapsed(FILE* f) const
+{
+	for (const auto& s : stacks)
+	{
+		const std::vector<word>& key = s.first;
+		for (size_t i = 0; i < key.size(); i++)
+			std::fprintf(f, "%s0x%03X", i ? ";" : "", key[i]);
+		std::fprintf(f, " %" PRIu64 "\n", s.second);
+	}
+}
@@ -0,0 +1,198 @@
+#include "rewind.h"
+
+#include <cstring>
+
+using namespace chip8;
+
+// 字面量中不超过这个长度的相同字节不单独断开
+constexpr size_t MIN_ZERO_RUN = 3;
+
+static void put_varint(std::vector<byte>& out, size_t v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((byte)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((byte)v);
+}
+
+static size_t get_varint(const byte*& p)
+{
+	size_t v = 0;
+	int shift = 0;
+	while (*p & 0x80)
+	{
+		v |= (size_t)(*p++ & 0x7F) << shift;
+		shift += 7;
+	}
+	return v | ((size_t)*p++ << shift);
+}
+
+// 去掉挂接的指针, 使相同的机器状态得到相同的字节
+static void capture(const machine_t& m, snapshot_t* s)
+{
+	m.snapshot(s);
+	s->m.profile = nullptr;
+	s->m.trace = nullptr;
+}
+
+rewind_t::rewind_t(size_t budget, int keyframe_interval)
+	: base{}, key_state{}, budget(budget), interval(keyframe_interval > 0 ? keyframe_interval : 1), count(0), used(0)
+{
+}
+
+void rewind_t::encode(const byte* a, const byte* b, std::vector<byte>& out)
+{
+	const size_t n = sizeof(machine_t);
+	size_t i = 0;
+	while (i < n)
+	{
+		// 跳过相同的字节, 先按8字节比较
+		size_t z = i;
+		while (z + 8 <= n && !std::memcmp(a + z, b + z, 8))
+			z += 8;
+		while (z < n && a[z] == b[z])
+			z++;
+		if (z == n)
+			break;
+
+		// 字面量延续到连续MIN_ZERO_RUN个相同字节之前
+		size_t l = z;
+		size_t same = 0;
+		while (l < n && same < MIN_ZERO_RUN)
+		{
+			same = a[l] == b[l] ? same + 1 : 0;
+			l++;
+		}
+		if (same == MIN_ZERO_RUN)
+			l -= same;
+
+		put_varint(out, z - i);
+		put_varint(out, l - z);
+		for (size_t k = z; k < l; k++)
+			out.push_back(a[k] ^ b[k]);
+		i = l;
+	}
+}
+
+void rewind_t::apply(const byte* src, size_t len, byte* dst)
+{
+	const byte* end = src + len;
+	size_t pos = 0;
+	while (src < end)
+	{
+		pos += get_varint(src);
+		size_t lit = get_varint(src);
+		for (size_t k = 0; k < lit; k++)
+			dst[pos++] ^= *src++;
+	}
+}
+
+size_t rewind_t::segment_bytes(const segment_t& s)
+{
+	return s.key.size() + s.deltas.size() + s.ends.size() * sizeof(uint32_t);
+}
+
+void rewind_t::push(const machine_t& m)
+{
+	static thread_local snapshot_t cur;
+	capture(m, &cur);
+
+	if (!count)
+		base = cur;
+
+	if (segments.empty() || (int)segments.back().ends.size() >= interval)
+	{
+		segments.emplace_back();
+		segment_t& s = segments.back();
+		encode((const byte*)&cur, (const byte*)&base, s.key);
+		s.ends.push_back(0);
+		key_state = cur;
+		used += segment_bytes(s);
+	}
+	else
+	{
+		segment_t& s = segments.back();
+		size_t before = segment_bytes(s);
+		encode((const byte*)&cur, (const byte*)&key_state, s.deltas);
+		s.ends.push_back((uint32_t)s.deltas.size());
+		used += segment_bytes(s) - before;
+	}
+	count++;
+
+	// 超出预算时丢弃最旧的段, 至少保留正在写入的一段
+	while (used > budget && segments.size() > 1)
+	{
+		used -= segment_bytes(segments.front());
+		count -= segments.front().ends.size();
+		segments.pop_front();
+	}
+}
+
+bool rewind_t::restore(machine_t& m, size_t back) const
+{
+	if (back >= count)
+		return false;
+
+	// 从最新的段向前找到所在的段
+	auto it = segments.end();
+	do
+	{
+		--it;
+		if (back < it->ends.size())
+			break;
+		back -= it->ends.size();
+	} while (it != segments.begin());
+
+	const segment_t& s = *it;
+	size_t idx = s.ends.size() - 1 - back;
+
+	static thread_local snapshot_t tmp;
+	tmp = base;
+	apply(s.key.data(), s.key.size(), (byte*)&tmp);
+
+	size_t begin = idx ? s.ends[idx - 1] : 0;
+	apply(s.deltas.data() + begin, s.ends[idx] - begin, (byte*)&tmp);
+
+	m.restore(tmp);
+	return true;
+}
+
+void rewind_t::drop(size_t n)
+{
+	while (n && !segments.empty())
+	{
+		segment_t& s = segments.back();
+		size_t before = segment_bytes(s);
+
+		size_t k = n < s.ends.size() ? n : s.ends.size();
+		s.ends.resize(s.ends.size() - k);
+		n -= k;
+		count -= k;
+
+		if (s.ends.empty())
+		{
+			used -= before;
+			segments.pop_back();
+			continue;
+		}
+		s.deltas.resize(s.ends.back());
+		used -= before - segment_bytes(s);
+	}
+
+	// 之后的帧继续以剩余最新段的关键帧为基准
+	if (!segments.empty())
+	{
+		const segment_t& s = segments.back();
+		key_state = base;
+		apply(s.key.data(), s.key.size(), (byte*)&key_state);
+	}
+}
+
+void rewind_t::clear()
+{
+	segments.clear();
+	count = 0;
+	used = 0;
+}
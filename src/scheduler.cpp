@@ -0,0 +1,279 @@
+#include "scheduler.h"
+
+#include "fork.h"
+
+using namespace chip8;
+
+using sched_clock = std::chrono::steady_clock;
+
+const char* chip8::park_str(park_t p)
+{
+	switch (p)
+	{
+		case PARK_NONE:
+			return "none";
+		case PARK_INPUT:
+			return "input";
+		case PARK_HALTED:
+			return "halted";
+		case PARK_DONE:
+			return "done";
+		default:
+			return "unknown";
+	}
+}
+
+scheduler_t::scheduler_t(int threads, int _quantum)
+	: quantum(_quantum > 0 ? _quantum : DEFAULT_QUANTUM), start(sched_clock::now()), queued(0), sleeping(0),
+	  next_worker(0), live(0), stopping(false)
+{
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+
+	// 先建好所有队列, 线程启动后就会互相偷取
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(new worker_t());
+	for (int i = 0; i < threads; i++)
+		workers[i]->thread = std::thread(&scheduler_t::worker_loop, this, i);
+}
+
+scheduler_t::~scheduler_t()
+{
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		stopping = true;
+	}
+	cv.notify_all();
+
+	for (std::unique_ptr<worker_t>& w : workers)
+		w->thread.join();
+}
+
+int scheduler_t::add(const machine_t& m, uint64_t cycles)
+{
+	slot_t* s = new slot_t();
+	slots.emplace_back(s);
+
+	fork(m, &s->m);
+	s->level = m.keys;
+	s->until = cycles > UNLIMITED_CYCLES - m.cycles ? UNLIMITED_CYCLES : m.cycles + cycles;
+	s->cycles = m.cycles;
+
+	std::lock_guard<std::mutex> lk(s->lock);
+	s->park = PARK_DONE;
+	wake(s);
+	return (int)slots.size() - 1;
+}
+
+void scheduler_t::set_keys(int id, word keys)
+{
+	slot_t* s = slots[id].get();
+	std::lock_guard<std::mutex> lk(s->lock);
+	// 记录两次执行之间松开过的键, 使按下又松开的键不会因合并而丢失
+	s->released |= s->level & ~keys;
+	s->level = keys;
+	s->has_keys = true;
+	if (s->park == PARK_INPUT)
+		wake(s);
+}
+
+void scheduler_t::extend(int id, uint64_t cycles)
+{
+	slot_t* s = slots[id].get();
+	std::lock_guard<std::mutex> lk(s->lock);
+	s->until = cycles > UNLIMITED_CYCLES - s->until ? UNLIMITED_CYCLES : s->until + cycles;
+	if (s->park == PARK_DONE)
+		wake(s);
+}
+
+void scheduler_t::load(int id, const machine_t& m)
+{
+	slot_t* s = slots[id].get();
+	std::lock_guard<std::mutex> lk(s->lock);
+	s->pending.reset(new machine_t(m));
+	// 之前的按键属于被替换的状态
+	s->level = m.keys;
+	s->released = 0;
+	s->has_keys = false;
+	wake(s);
+}
+
+void scheduler_t::wait_idle()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	idle_cv.wait(lk, [this] { return live == 0; });
+}
+
+machine_stats_t scheduler_t::machine_stats(int id)
+{
+	slot_t* s = slots[id].get();
+	std::lock_guard<std::mutex> lk(s->lock);
+	return {s->cycles, s->slices, s->parks, s->busy_ns, s->park};
+}
+
+worker_stats_t scheduler_t::worker_stats(int i) const
+{
+	const worker_t& w = *workers[i];
+	return {w.slices, w.steals, w.busy_ns};
+}
+
+uint64_t scheduler_t::uptime_ns() const
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(sched_clock::now() - start).count();
+}
+
+void scheduler_t::wake(slot_t* s)
+{
+	if (s->park == PARK_NONE)
+		return;
+	s->park = PARK_NONE;
+
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		live++;
+	}
+	push(next_worker, s, true);
+	next_worker = (next_worker + 1) % (int)workers.size();
+}
+
+void scheduler_t::push(int i, slot_t* s, bool notify)
+{
+	worker_t& w = *workers[i];
+	size_t size;
+	{
+		std::lock_guard<std::mutex> lk(w.lock);
+		w.queue.push_back(s);
+		size = w.queue.size();
+	}
+	queued++;
+
+	// 线程放回自己刚执行的机器时, 只有队列里还有其他机器才值得唤醒别的线程来偷
+	if ((notify || size > 1) && sleeping.load())
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		cv.notify_one();
+	}
+}
+
+scheduler_t::slot_t* scheduler_t::take(int self)
+{
+	worker_t& w = *workers[self];
+	{
+		std::lock_guard<std::mutex> lk(w.lock);
+		if (!w.queue.empty())
+		{
+			slot_t* s = w.queue.front();
+			w.queue.pop_front();
+			queued--;
+			return s;
+		}
+	}
+
+	int n = (int)workers.size();
+	for (int k = 1; k < n && queued.load() > 0; k++)
+	{
+		worker_t& v = *workers[(self + k) % n];
+		std::lock_guard<std::mutex> lk(v.lock);
+		if (!v.queue.empty())
+		{
+			slot_t* s = v.queue.back();
+			v.queue.pop_back();
+			queued--;
+			w.steals++;
+			return s;
+		}
+	}
+	return nullptr;
+}
+
+bool scheduler_t::run_slice(worker_t& w, slot_t* s)
+{
+	machine_t& m = s->m;
+	uint64_t until;
+	{
+		std::lock_guard<std::mutex> lk(s->lock);
+		if (s->pending)
+		{
+			fork(*s->pending, &m);
+			s->pending.reset();
+		}
+		if (s->has_keys)
+		{
+			// 与依次调用set_key_state相同: 松开过的键记入keys_released, 之后是最后一次的状态
+			for (int i = 0; i < 16; i++)
+			{
+				if ((s->released >> i) & 1)
+				{
+					m.set_key_state(i, true);
+					m.set_key_state(i, false);
+				}
+				m.set_key_state(i, (s->level >> i) & 1);
+			}
+			s->released = 0;
+			s->has_keys = false;
+		}
+		until = s->until;
+	}
+
+	if (m.cycles < until && !m.halted())
+	{
+		uint64_t left = until - m.cycles;
+		auto t0 = sched_clock::now();
+		m.run_for(left < (uint64_t)quantum ? (int)left : quantum);
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(sched_clock::now() - t0).count();
+
+		s->cycles = m.cycles;
+		s->slices++;
+		s->busy_ns += ns;
+		w.busy_ns += ns;
+	}
+	// 在离开队列之前计数, wait_idle返回后统计即是完整的
+	w.slices++;
+
+	park_t p = PARK_NONE;
+	if (m.halted())
+		p = PARK_HALTED;
+	else if (m.cycles >= until)
+		p = PARK_DONE;
+	else if (m.idle() == IDLE_INPUT)
+		p = PARK_INPUT;
+	if (p == PARK_NONE)
+		return true;
+
+	std::lock_guard<std::mutex> lk(s->lock);
+	// 执行期间到达的事件可能已经改变了结果
+	if (s->pending || s->has_keys || s->until != until)
+		return true;
+
+	s->park = p;
+	s->parks++;
+
+	std::lock_guard<std::mutex> g(lock);
+	if (!--live)
+		idle_cv.notify_all();
+	return false;
+}
+
+void scheduler_t::worker_loop(int self)
+{
+	worker_t& w = *workers[self];
+	for (;;)
+	{
+		slot_t* s = take(self);
+		if (!s)
+		{
+			std::unique_lock<std::mutex> lk(lock);
+			sleeping++;
+			cv.wait(lk, [this] { return stopping || queued.load() > 0; });
+			sleeping--;
+			if (stopping)
+				return;
+			continue;
+		}
+
+		if (run_slice(w, s))
+			push(self, s, false);
+	}
+}
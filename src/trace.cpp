@@ -0,0 +1,483 @@
+#include "trace.h"
+
+#include <cinttypes>
+#include <cstring>
+
+using namespace chip8;
+
+const char* chip8::trace_str(const trace_state_t& s)
+{
+	static thread_local char _buf[300]{};
+
+	int n = std::snprintf(_buf, sizeof(_buf), "%" PRIu64 " PC=0x%04X,IR=0x%04X,I=0x%04X,SP=%d reg={", s.cycles, s.PC,
+		s.IR, s.I, s.SP);
+	for (int i = 0; i < 16; i++)
+		n += std::snprintf(_buf + n, sizeof(_buf) - n, "%X:0x%02X,", i, s.reg[i]);
+	std::snprintf(_buf + n, sizeof(_buf) - n, "} state=%s,st=%d,dt=%d,keys=0x%04X", state_str((state_t)s.state), s.st,
+		s.dt, s.keys);
+
+	return _buf;
+}
+
+trace_writer_t::trace_writer_t()
+	: file(nullptr), count(0), last{}, synced(false), buf(nullptr), used(0), pending(nullptr), pending_len(0),
+	  stopping(false)
+{
+	buffers[0] = new byte[BUFFER_SIZE];
+	buffers[1] = new byte[BUFFER_SIZE];
+	buf = buffers[0];
+}
+
+trace_writer_t::~trace_writer_t()
+{
+	close();
+	delete[] buffers[0];
+	delete[] buffers[1];
+}
+
+bool trace_writer_t::open(const char* path)
+{
+	close();
+
+	file = std::fopen(path, "wb");
+	if (!file)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	byte header[6];
+	std::memcpy(header, TRACE_MAGIC, 4);
+	header[4] = (byte)TRACE_VERSION;
+	header[5] = (byte)(TRACE_VERSION >> 8);
+	std::fwrite(header, 1, sizeof(header), file);
+
+	count = 0;
+	synced = false;
+	buf = buffers[0];
+	used = 0;
+	pending = nullptr;
+	stopping = false;
+	writer = std::thread(&trace_writer_t::writer_loop, this);
+	return true;
+}
+
+void trace_writer_t::close()
+{
+	if (!file)
+		return;
+
+	if (used)
+		submit();
+
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		stopping = true;
+	}
+	cv.notify_all();
+	writer.join();
+
+	std::fclose(file);
+	file = nullptr;
+}
+
+void trace_writer_t::submit()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	cv.wait(lk, [this] { return !pending; });
+	pending = buf;
+	pending_len = used;
+	lk.unlock();
+	cv.notify_all();
+
+	buf = buf == buffers[0] ? buffers[1] : buffers[0];
+	used = 0;
+}
+
+void trace_writer_t::writer_loop()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	for (;;)
+	{
+		cv.wait(lk, [this] { return pending || stopping; });
+
+		// 先写完已提交的缓冲再退出
+		if (pending)
+		{
+			lk.unlock();
+			std::fwrite(pending, 1, pending_len, file);
+			lk.lock();
+
+			pending = nullptr;
+			cv.notify_all();
+		}
+		else
+			break;
+	}
+	std::fflush(file);
+}
+
+void trace_writer_t::keyframe(const machine_t& m)
+{
+	put8(TRACE_EXT);
+	put8(TRACE_KEYFRAME);
+	for (int i = 0; i < 8; i++)
+		put8((byte)(m.cycles >> (i * 8)));
+	put16(m.PC);
+	put16(m.IR);
+	put16(m.I);
+	put8(m.SP);
+	for (int i = 0; i < STACK_DEEP; i++)
+		put16(m.stack[i]);
+	for (int i = 0; i < 16; i++)
+		put8(m.reg[i]);
+	put8(m.dt);
+	put8(m.st);
+	put8((byte)m.state);
+	put16(m.keys);
+
+	last.cycles = m.cycles;
+	last.PC = m.PC;
+	last.IR = m.IR;
+	last.I = m.I;
+	last.SP = m.SP;
+	std::memcpy(last.stack, m.stack, sizeof(last.stack));
+	std::memcpy(last.reg, m.reg, sizeof(last.reg));
+	last.dt = m.dt;
+	last.st = m.st;
+	last.state = (byte)m.state;
+	last.keys = m.keys;
+	synced = true;
+}
+
+void trace_writer_t::record(const machine_t& m)
+{
+	if (!file)
+		return;
+
+	if (used + MAX_RECORD > BUFFER_SIZE)
+		submit();
+	count++;
+
+	if (!synced || m.cycles != last.cycles + 1 || m.cycles % TRACE_KEYFRAME_INTERVAL == 0)
+	{
+		keyframe(m);
+		return;
+	}
+	last.cycles = m.cycles;
+
+	if (m.keys != last.keys)
+	{
+		put8(TRACE_EXT);
+		put8(TRACE_KEYS);
+		put16(m.keys);
+		last.keys = m.keys;
+	}
+
+	size_t at = used++;
+	byte tag = 0;
+
+	if (m.PC != (word)(last.PC + 2))
+	{
+		tag |= TRACE_PC;
+		put16(m.PC);
+	}
+	last.PC = m.PC;
+
+	if (m.IR != last.IR)
+	{
+		tag |= TRACE_IR;
+		put16(m.IR);
+		last.IR = m.IR;
+	}
+
+	if (m.I != last.I)
+	{
+		tag |= TRACE_I;
+		put16(m.I);
+		last.I = m.I;
+	}
+
+	// 大多数周期最多只改变一个寄存器
+	word mask = 0;
+	if (std::memcmp(m.reg, last.reg, sizeof(last.reg)))
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			if (m.reg[i] != last.reg[i])
+				mask |= 1 << i;
+		}
+	}
+	if (mask)
+	{
+		tag |= TRACE_REG;
+		put16(mask);
+		for (int i = 0; i < 16; i++)
+		{
+			if (mask & (1 << i))
+			{
+				put8(m.reg[i]);
+				last.reg[i] = m.reg[i];
+			}
+		}
+	}
+
+	// 栈上只有栈顶会在一个周期内变化
+	int top = m.SP - 1;
+	bool top_valid = top >= 0 && top < STACK_DEEP;
+	if (m.SP != last.SP || (top_valid && m.stack[top] != last.stack[top]))
+	{
+		tag |= TRACE_SP;
+		put8(m.SP);
+		if (m.SP)
+		{
+			word v = top_valid ? m.stack[top] : 0;
+			put16(v);
+			if (top_valid)
+				last.stack[top] = v;
+		}
+		last.SP = m.SP;
+	}
+
+	if (m.dt != last.dt || m.st != last.st)
+	{
+		tag |= TRACE_TIMER;
+		put8(m.dt);
+		put8(m.st);
+		last.dt = m.dt;
+		last.st = m.st;
+	}
+
+	if ((byte)m.state != last.state)
+	{
+		tag |= TRACE_STATE;
+		put8((byte)m.state);
+		last.state = (byte)m.state;
+	}
+
+	buf[at] = tag;
+}
+
+trace_reader_t::trace_reader_t() : file(nullptr), pos(0), cur{}, synced(false), corrupt(false), gap_bytes(0) {}
+
+trace_reader_t::~trace_reader_t() { close(); }
+
+bool trace_reader_t::open(const char* path)
+{
+	close();
+
+	file = std::fopen(path, "rb");
+	if (!file)
+	{
+		std::printf("Error: Could not open %s\n", path);
+		return false;
+	}
+
+	byte header[6];
+	if (std::fread(header, 1, sizeof(header), file) != sizeof(header) || std::memcmp(header, TRACE_MAGIC, 4) ||
+		(header[4] | (header[5] << 8)) != TRACE_VERSION)
+	{
+		std::printf("Error: %s is not a chip9 trace\n", path);
+		close();
+		return false;
+	}
+
+	pos = sizeof(header);
+	synced = false;
+	corrupt = false;
+	gap_bytes = 0;
+	return true;
+}
+
+void trace_reader_t::close()
+{
+	if (file)
+		std::fclose(file);
+	file = nullptr;
+}
+
+bool trace_reader_t::get8(byte* v)
+{
+	int c = std::getc(file);
+	if (c == EOF)
+		return false;
+	pos++;
+	*v = (byte)c;
+	return true;
+}
+
+bool trace_reader_t::get16(word* v)
+{
+	byte l, h;
+	if (!get8(&l) || !get8(&h))
+		return false;
+	*v = (word)(l | (h << 8));
+	return true;
+}
+
+bool trace_reader_t::read_keyframe()
+{
+	byte b;
+	cur.cycles = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		if (!get8(&b))
+			return false;
+		cur.cycles |= (uint64_t)b << (i * 8);
+	}
+	if (!get16(&cur.PC) || !get16(&cur.IR) || !get16(&cur.I) || !get8(&cur.SP))
+		return false;
+	for (int i = 0; i < STACK_DEEP; i++)
+		if (!get16(&cur.stack[i]))
+			return false;
+	for (int i = 0; i < 16; i++)
+		if (!get8(&cur.reg[i]))
+			return false;
+	if (!get8(&cur.dt) || !get8(&cur.st) || !get8(&cur.state) || !get16(&cur.keys))
+		return false;
+
+	return cur.SP <= STACK_DEEP && cur.state <= STATE_ERROR_POP_EMPTY_STAKC;
+}
+
+int trace_reader_t::read_record(trace_state_t* s)
+{
+	byte tag;
+	while (get8(&tag))
+	{
+		if (tag == TRACE_EXT)
+		{
+			byte kind;
+			if (!get8(&kind))
+				return -1;
+
+			if (kind == TRACE_KEYS)
+			{
+				if (!get16(&cur.keys))
+					return -1;
+				continue;
+			}
+			if (kind != TRACE_KEYFRAME || !read_keyframe())
+				return -1;
+
+			synced = true;
+			*s = cur;
+			return 1;
+		}
+
+		// 第一个关键帧之前的增量记录无法解码
+		if (!synced)
+			return -1;
+
+		cur.cycles++;
+		if (tag & TRACE_PC)
+		{
+			if (!get16(&cur.PC))
+				return -1;
+		}
+		else
+			cur.PC += 2;
+
+		if ((tag & TRACE_IR) && !get16(&cur.IR))
+			return -1;
+		if ((tag & TRACE_I) && !get16(&cur.I))
+			return -1;
+
+		if (tag & TRACE_REG)
+		{
+			word mask;
+			if (!get16(&mask))
+				return -1;
+			for (int i = 0; i < 16; i++)
+				if ((mask & (1 << i)) && !get8(&cur.reg[i]))
+					return -1;
+		}
+
+		if (tag & TRACE_SP)
+		{
+			if (!get8(&cur.SP))
+				return -1;
+			if (cur.SP)
+			{
+				word v;
+				if (!get16(&v))
+					return -1;
+				if (cur.SP <= STACK_DEEP)
+					cur.stack[cur.SP - 1] = v;
+			}
+		}
+
+		if ((tag & TRACE_TIMER) && (!get8(&cur.dt) || !get8(&cur.st)))
+			return -1;
+		if ((tag & TRACE_STATE) && !get8(&cur.state))
+			return -1;
+
+		*s = cur;
+		return 1;
+	}
+	return 0;
+}
+
+// 数据中常有与关键帧开头相同的字节
+// 返回地址总在内存范围内, 据此排除绝大多数误判
+static bool plausible_keyframe(const trace_state_t& s)
+{
+	for (int i = 0; i < STACK_DEEP; i++)
+	{
+		if (s.stack[i] >= MEM_SIZE)
+			return false;
+	}
+	return true;
+}
+
+bool trace_reader_t::resync(uint64_t from, uint64_t* found)
+{
+	synced = false;
+	for (;;)
+	{
+		if (std::fseek(file, (long)from, SEEK_SET))
+			return false;
+		pos = from;
+
+		// 逐字节查找TRACE_EXT, TRACE_KEYFRAME
+		byte b;
+		bool ext = false, tagged = false;
+		while (!tagged && get8(&b))
+		{
+			tagged = ext && b == TRACE_KEYFRAME;
+			ext = b == TRACE_EXT;
+		}
+		if (!tagged)
+			return false;
+
+		*found = pos - 2;
+		if (read_keyframe() && plausible_keyframe(cur))
+		{
+			synced = true;
+			return true;
+		}
+		from = *found + 1;
+	}
+}
+
+bool trace_reader_t::next(trace_state_t* s)
+{
+	if (!file || corrupt)
+		return false;
+
+	gap_bytes = 0;
+	uint64_t at = pos;
+	int res = read_record(s);
+	if (res >= 0)
+		return res > 0;
+
+	// 记录中途结束或格式错误, 从出错记录的下一个字节开始查找关键帧
+	uint64_t found;
+	if (!resync(at + 1, &found))
+	{
+		corrupt = true;
+		return false;
+	}
+	gap_bytes = found - at;
+	*s = cur;
+	return true;
+}
@@ -0,0 +1,215 @@
+// chip9-trace: 执行轨迹的解码工具
+// 用法:
+//   chip9-trace dump <trace> [--from cycle] [--count N]   以文本输出每个周期的状态
+//   chip9-trace diff <a> <b> [--context N]               找出两份轨迹第一次出现分歧的周期
+#include "trace.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+
+using namespace chip8;
+
+static void usage(const char* name)
+{
+	std::printf("usage: %s dump <trace> [--from cycle] [--count N]\n"
+				"       %s diff <a> <b> [--context N]\n",
+		name, name);
+}
+
+// 解码下一个周期, 跳过损坏的部分时输出跳过的范围
+// started表示s中已有之前解码的状态
+static bool next_state(trace_reader_t& r, const char* path, trace_state_t* s, bool started, uint64_t* gaps)
+{
+	uint64_t last = s->cycles;
+	if (!r.next(s))
+		return false;
+
+	if (r.gap())
+	{
+		(*gaps)++;
+		if (started)
+			std::printf("Error: %s is corrupt after cycle %" PRIu64 ", skipped %" PRIu64
+						" bytes to the keyframe at cycle %" PRIu64 "\n",
+				path, last, r.gap(), s->cycles);
+		else
+			std::printf("Error: %s is corrupt at the start, skipped %" PRIu64 " bytes to the keyframe at cycle %" PRIu64
+						"\n",
+				path, r.gap(), s->cycles);
+	}
+	return true;
+}
+
+static int dump(const char* path, uint64_t from, uint64_t limit)
+{
+	trace_reader_t r;
+	if (!r.open(path))
+		return 1;
+
+	trace_state_t s{};
+	uint64_t printed = 0, gaps = 0;
+	bool started = false;
+	while (printed < limit && next_state(r, path, &s, started, &gaps))
+	{
+		started = true;
+		if (s.cycles < from)
+			continue;
+		std::printf("%s\n", trace_str(s));
+		printed++;
+	}
+
+	if (r.bad())
+	{
+		std::printf("Error: %s is corrupt after cycle %" PRIu64 "\n", path, s.cycles);
+		return 1;
+	}
+	return gaps ? 1 : 0;
+}
+
+// 比较两个状态, 将不同的字段写入out
+static bool same_state(const trace_state_t& a, const trace_state_t& b, char* out, size_t len)
+{
+	int n = 0;
+	out[0] = 0;
+
+#define CMP_FIELD(name, fmt)                                                                                           \
+	if (a.name != b.name && n < (int)len)                                                                              \
+		n += std::snprintf(out + n, len - n, " " #name "=" fmt "/" fmt, a.name, b.name);
+
+	CMP_FIELD(PC, "0x%04X");
+	CMP_FIELD(IR, "0x%04X");
+	CMP_FIELD(I, "0x%04X");
+	CMP_FIELD(SP, "%d");
+	CMP_FIELD(dt, "%d");
+	CMP_FIELD(st, "%d");
+	CMP_FIELD(state, "%d");
+	CMP_FIELD(keys, "0x%04X");
+#undef CMP_FIELD
+
+	for (int i = 0; i < 16; i++)
+	{
+		if (a.reg[i] != b.reg[i] && n < (int)len)
+			n += std::snprintf(out + n, len - n, " V%X=0x%02X/0x%02X", i, a.reg[i], b.reg[i]);
+	}
+	for (int i = 0; i < STACK_DEEP && i < a.SP && i < b.SP; i++)
+	{
+		if (a.stack[i] != b.stack[i] && n < (int)len)
+			n += std::snprintf(out + n, len - n, " stack[%d]=0x%04X/0x%04X", i, a.stack[i], b.stack[i]);
+	}
+	return n == 0;
+}
+
+static int diff(const char* path_a, const char* path_b, size_t context)
+{
+	trace_reader_t ra, rb;
+	if (!ra.open(path_a) || !rb.open(path_b))
+		return 1;
+
+	// 分歧之前最近的若干个相同周期
+	std::deque<trace_state_t> history;
+
+	trace_state_t a{}, b{};
+	uint64_t gaps = 0;
+	bool has_a = next_state(ra, path_a, &a, false, &gaps);
+	bool has_b = next_state(rb, path_b, &b, false, &gaps);
+	uint64_t compared = 0;
+
+	while (has_a && has_b)
+	{
+		// 损坏而跳过的部分与之前的周期不连续
+		if (ra.gap() || rb.gap())
+			history.clear();
+
+		// 按周期对齐, 两份轨迹的起点或中间的空缺可能不同
+		if (a.cycles < b.cycles)
+		{
+			has_a = next_state(ra, path_a, &a, true, &gaps);
+			continue;
+		}
+		if (b.cycles < a.cycles)
+		{
+			has_b = next_state(rb, path_b, &b, true, &gaps);
+			continue;
+		}
+
+		char fields[512];
+		if (!same_state(a, b, fields, sizeof(fields)))
+		{
+			for (const trace_state_t& h : history)
+				std::printf("  %s\n", trace_str(h));
+			std::printf("- %s\n", trace_str(a));
+			std::printf("+ %s\n", trace_str(b));
+			std::printf("diverged at cycle %" PRIu64 " after %" PRIu64 " matching cycles:%s\n", a.cycles, compared,
+				fields);
+			return 1;
+		}
+
+		compared++;
+		if (context)
+		{
+			history.push_back(a);
+			if (history.size() > context)
+				history.pop_front();
+		}
+
+		has_a = next_state(ra, path_a, &a, true, &gaps);
+		has_b = next_state(rb, path_b, &b, true, &gaps);
+	}
+
+	if (ra.bad() || rb.bad())
+	{
+		std::printf("Error: %s is corrupt\n", ra.bad() ? path_a : path_b);
+		return 1;
+	}
+
+	std::printf("%" PRIu64 " matching cycles", compared);
+	if (has_a || has_b)
+		std::printf(", %s is longer", has_a ? path_a : path_b);
+	if (gaps)
+		std::printf(", %" PRIu64 " corrupt ranges skipped", gaps);
+	std::printf("\n");
+	return gaps ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc >= 3 && !std::strcmp(argv[1], "dump"))
+	{
+		uint64_t from = 0;
+		uint64_t count = UINT64_MAX;
+		for (int i = 3; i < argc; i++)
+		{
+			if (!std::strcmp(argv[i], "--from") && i + 1 < argc)
+				from = std::strtoull(argv[++i], nullptr, 10);
+			else if (!std::strcmp(argv[i], "--count") && i + 1 < argc)
+				count = std::strtoull(argv[++i], nullptr, 10);
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		return dump(argv[2], from, count);
+	}
+
+	if (argc >= 4 && !std::strcmp(argv[1], "diff"))
+	{
+		size_t context = 8;
+		for (int i = 4; i < argc; i++)
+		{
+			if (!std::strcmp(argv[i], "--context") && i + 1 < argc)
+				context = (size_t)std::strtoull(argv[++i], nullptr, 10);
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+		}
+		return diff(argv[2], argv[3], context);
+	}
+
+	usage(argv[0]);
+	return 1;
+}